@@ -1,6 +1,8 @@
 #define RISCV 1 // 1 for production, 0 to disable RISC-V specific code when testing on another, faster, platform.
 
 #define NUM_BODIES 3
+#define SYMMETRIC_PAIRS 0 // 1 to compute each pair once in the simulation without the accelerator, the cycles below are with 0
+#define LEAPFROG 0 // 1 for the kick-drift-kick integrator instead of Euler, with and without the accelerator
 
 #if RISCV
 #include "mmio.h"
@@ -35,6 +37,27 @@ With accelerator : 1706 setup cycles, 68 436 run cycles.
 #define CELESTIAL_LOCKED    0x4010
 #define CELESTIAL_DOUT         0x4020
 #define CELESTIAL_ITERATION    0x4030
+#define CELESTIAL_RECORD_HEAD       0x4040
+#define CELESTIAL_RECORD_TAIL       0x4050
+#define CELESTIAL_RECORD_DROPPED    0x4060
+
+// With several partitions, the registers of partition p are at the same offsets, moved by p * CELESTIAL_PARTITION_STRIDE
+// The functions below use the first partition
+#define CELESTIAL_PARTITION_STRIDE  0x100
+#define CELESTIAL_PARTITION_REG(reg, p) ((reg) + (p) * CELESTIAL_PARTITION_STRIDE)
+
+#define CELESTIAL_STATUS_DMA_BUSY (1u << 30)
+#define CELESTIAL_STATUS_IRQ_DONE       (1u << 27)
+#define CELESTIAL_STATUS_IRQ_COLLISION  (1u << 28)
+#define CELESTIAL_STATUS_IRQ_TICK       (1u << 29)
+
+// PLIC, the source ID of the accelerator depends on the design, check the generated device tree
+#define PLIC_BASE               0x0C000000
+#define PLIC_PRIORITY(id)       (PLIC_BASE + 4 * (id))
+#define PLIC_ENABLE_HART0       (PLIC_BASE + 0x2000)
+#define PLIC_THRESHOLD_HART0    (PLIC_BASE + 0x200000)
+#define PLIC_CLAIM_HART0        (PLIC_BASE + 0x200004)
+#define CELESTIAL_PLIC_ID       1 // First partition, partition p uses CELESTIAL_PLIC_ID + p
 
 #pragma endregion
 
@@ -65,6 +88,44 @@ With accelerator : 1706 setup cycles, 68 436 run cycles.
 #define CMD_OUTPUT_DY           22
 #define CMD_OUTPUT_DZ           23
 #define CMD_OUTPUT_COLLISION_ID 24
+#define CMD_LOAD_BODY_WORD      25
+#define CMD_COMMIT_BODY         26
+#define CMD_DMA_TRANSFER        27
+#define CMD_SET_CONFIG          28
+#define CMD_OUTPUT_RECORD       29
+#define CMD_SET_MASSLESS        30
+#define CMD_SET_GRAVITY         31
+
+#pragma endregion
+
+#pragma region Configuration registers
+
+#define CFG_IRQ_ENABLE          0
+#define CFG_IRQ_TICK_INTERVAL   1
+#define CFG_IRQ_CLEAR           2
+#define CFG_RECORD_INTERVAL     3
+#define CFG_RECORD_VELOCITY     4
+#define CFG_REFINEMENTS         5
+#define CFG_DISTANCE_SCALE      6
+#define CFG_LEAPFROG            7
+#define CFG_BLOCK_LEVELS        8
+#define CFG_BODY_LEVEL          9
+#define CFG_MERGE_COLLISIONS    10
+#define CFG_CHECKPOINT          11
+
+#define IRQ_DONE                0x1
+#define IRQ_COLLISION           0x2
+#define IRQ_TICK                0x4
+
+// Bit 31 of the first word of a recorder entry tells a merged collision from a frame
+#define RECORD_COLLISION_EVENT  0x80000000u
+
+// Bit 0 of the start and stop commands: resume the simulation, pause it at the end of the iteration
+#define SIMULATION_RESUME       0x1
+#define SIMULATION_PAUSE        0x1
+
+// Records of a checkpoint of n bodies: the header, then the values and the flags of each body
+#define CHECKPOINT_RECORDS(n)   (1 + 2 * (n))
 
 #pragma endregion
 
@@ -274,6 +335,14 @@ void setSize(float size, uint32_t lock)
     sendPacket(data, cmd, lock);
 }
 
+void setMassless(uint32_t target, int massless, uint32_t lock)
+{
+    // Test particle: the body is still updated by the others, but isn't broadcast anymore
+    uint32_t data = (massless ? 0x80000000u : 0) | (target & 0x7FFFFFFF);
+    uint8_t cmd = CMD_SET_MASSLESS;
+    sendPacket(data, cmd, lock);
+}
+
 void sendPosition(float x, float y, float z, int targetBPE, uint32_t lock)
 {
     // Send the position to the accelerator. Also forwards the size and mass if previously set
@@ -328,6 +397,47 @@ void setStopOnCollision(uint32_t stopOnCollision, uint32_t lock)
     sendPacket(data, cmd, lock);
 }
 
+void setConfig(uint8_t id, uint32_t value, uint32_t lock)
+{
+    // The configuration register ID is in the 8 MSBs of the data, the value in the 24 LSBs
+    uint32_t data = ((uint32_t)id << 24) | (value & 0x00FFFFFF);
+    sendPacket(data, CMD_SET_CONFIG, lock);
+}
+
+void setGravity(float G, uint32_t lock)
+{
+    // The accelerator multiplies the masses by G when they are loaded
+    sendPacket(floatToBits(G), CMD_SET_GRAVITY, lock);
+}
+
+void setDistanceScale(int exponent, uint32_t lock)
+{
+    // The accelerator works on the distances multiplied by 2^exponent, the host sends and reads them in meters
+    setConfig(CFG_DISTANCE_SCALE, (uint32_t)exponent & 0xFF, lock);
+}
+
+void setBodyLevel(uint32_t target, uint32_t level, uint32_t lock)
+{
+    // Block timesteps: the velocity of the target is updated with dt / 2^level, every 2^(levels - level) sub-steps
+    setConfig(CFG_BODY_LEVEL, ((level & 0x7) << 21) | (target & 0x1FFFFF), lock);
+}
+
+void setMergeCollisions(int merge, uint32_t lock)
+{
+    // The bodies that collide are merged into the heavier one and the simulation goes on, the other one is left empty
+    setConfig(CFG_MERGE_COLLISIONS, merge ? 1 : 0, lock);
+}
+
+void enableCelestialInterrupt(void)
+{
+    // Route the accelerator's interrupt to hart 0. The global interrupt enable stays off:
+    // wfi still wakes up the core, without taking a trap
+    reg_write32(PLIC_PRIORITY(CELESTIAL_PLIC_ID), 1);
+    reg_write32(PLIC_ENABLE_HART0 + 4 * (CELESTIAL_PLIC_ID / 32), 1u << (CELESTIAL_PLIC_ID % 32));
+    reg_write32(PLIC_THRESHOLD_HART0, 0);
+    asm volatile ("csrs mie, %0" :: "r"(1 << 11)); // Machine external interrupt
+}
+
 void startimulation(uint32_t lock)
 {
     // Start the simulation
@@ -336,6 +446,18 @@ void startimulation(uint32_t lock)
     sendPacket(data, cmd, lock);
 }
 
+void pauseSimulation(uint32_t lock)
+{
+    // The simulation stops at the end of the current iteration and raises IRQ_DONE, it can then be checkpointed
+    sendPacket(SIMULATION_PAUSE, CMD_STOP_SIMULATION, lock);
+}
+
+void resumeSimulation(uint32_t lock)
+{
+    // Go on from the next iteration of a paused or restored simulation, without resetting the iteration counter
+    sendPacket(SIMULATION_RESUME, CMD_START_SIMULATION, lock);
+}
+
 void sendKeepAlive( uint32_t lock)
 {
     // Send the keep alive flag to the accelerator
@@ -344,6 +466,64 @@ void sendKeepAlive( uint32_t lock)
     sendPacket(data, cmd, lock);
 }
 
+void loadBody(struct CelestialBody *body, int targetBPE, uint32_t lock)
+{
+    // Send the full record, in the same order as the struct, then commit it to the target BPE in one operation
+    float words[8] = {body->x, body->y, body->z, body->vx, body->vy, body->vz, body->mass, body->size};
+    for (int i = 0; i < 8; i++) {
+        sendPacket(floatToBits(words[i]), CMD_LOAD_BODY_WORD, lock);
+    }
+    sendPacket(targetBPE, CMD_COMMIT_BODY, lock);
+}
+
+// Start a DMA transfer of numBodies records, between the array at addr and the BPUs 0 to numBodies-1
+// The array must be 32 bytes aligned
+void dmaTransfer(uintptr_t addr, uint32_t numBodies, int store, uint32_t lock)
+{
+    uint64_t addr64 = (uint64_t)addr;
+    // The address goes through the X and Y registers
+    sendPacket((uint32_t)(addr64 & 0xFFFFFFFF), CMD_SET_X, lock);
+    sendPacket((uint32_t)(addr64 >> 32), CMD_SET_Y, lock);
+    uint32_t data = ((store ? 1u : 0u) << 31) | (numBodies & 0x7FFFFFFF);
+    sendPacket(data, CMD_DMA_TRANSFER, lock);
+}
+
+void waitForDMA(void)
+{
+    while (reg_read32(CELESTIAL_LOCKED) & CELESTIAL_STATUS_DMA_BUSY) {
+        // Wait for the DMA engine to finish
+    }
+}
+
+void dmaLoadBodies(struct CelestialBody *bodies, uint32_t numBodies, uint32_t lock)
+{
+    dmaTransfer((uintptr_t)bodies, numBodies, 0, lock);
+    waitForDMA();
+}
+
+void dmaStoreBodies(struct CelestialBody *bodies, uint32_t numBodies, uint32_t lock)
+{
+    dmaTransfer((uintptr_t)bodies, numBodies, 1, lock);
+    waitForDMA();
+}
+
+// Save the whole simulation in checkpoint, which must hold CHECKPOINT_RECORDS(number of active bodies) records
+// The values are in the units of the BPUs, the checkpoint is only meant to be restored
+void dmaStoreCheckpoint(struct CelestialBody *checkpoint, uint32_t lock)
+{
+    setConfig(CFG_CHECKPOINT, 1, lock);
+    dmaTransfer((uintptr_t)checkpoint, 0, 1, lock);
+    waitForDMA();
+}
+
+// Load a checkpoint back, the number of bodies is the fourth value of its header
+void dmaRestoreCheckpoint(struct CelestialBody *checkpoint, uint32_t lock)
+{
+    setConfig(CFG_CHECKPOINT, 1, lock);
+    dmaTransfer((uintptr_t)checkpoint, floatToBits(checkpoint[0].vx), 0, lock);
+    waitForDMA();
+}
+
 #pragma endregion
 
 #pragma region Output functions
@@ -429,6 +609,24 @@ float getDZ(uint32_t lock)
     return dz;    
 }
 
+// Copy the words available in the trajectory recorder to out, returns the number of words read.
+// Each frame is the iteration number, followed by X, Y, Z (and dX, dY, dZ if enabled) of each active BPE
+// When the collisions are merged, each merge is 3 words: the iteration | RECORD_COLLISION_EVENT, then the body that
+// took the merged record, and the one that was absorbed
+int drainRecorder(uint32_t *out, int maxWords, uint32_t lock)
+{
+    uint32_t head = reg_read32(CELESTIAL_RECORD_HEAD);
+    uint32_t tail = reg_read32(CELESTIAL_RECORD_TAIL);
+    int available = (int)(head - tail);
+    int count = available < maxWords ? available : maxWords;
+    for (int i = 0; i < count; i++) {
+        uint32_t data = rand();
+        sendPacket(data, CMD_OUTPUT_RECORD, lock);
+        out[i] = read_dOut() ^ data;
+    }
+    return count;
+}
+
 uint32_t getIteration(uint32_t lock)
 {
     uint32_t iteration = reg_read32(CELESTIAL_ITERATION);
@@ -535,8 +733,60 @@ void updateVelocity(struct CelestialBody *target, struct CelestialBody *source,
     target->vz += acc_multiplier * dz;
 }
 
+// Same as updateVelocity on both bodies, the distance term is computed once for the pair
+void updateVelocityPair(struct CelestialBody *a, struct CelestialBody *b, float dt)
+{
+    float G = 6.67430e-11f;
+    float dx = b->x - a->x;
+    float dy = b->y - a->y;
+    float dz = b->z - a->z;
+
+    float distSq = dx * dx + dy * dy + dz * dz;
+    float invDist = fastInvSqrt(distSq, 3);
+    float invDistCube = invDist * invDist * invDist;
+
+    float scaled = G * invDistCube * dt;
+    float multiplierA = scaled * b->mass;
+    float multiplierB = scaled * a->mass;
+
+    a->vx += multiplierA * dx;
+    a->vy += multiplierA * dy;
+    a->vz += multiplierA * dz;
+    b->vx -= multiplierB * dx;
+    b->vy -= multiplierB * dy;
+    b->vz -= multiplierB * dz;
+}
+
+void updateVelocities(struct CelestialBody *bodies, float dt, int numBodies)
+{
+#if SYMMETRIC_PAIRS
+    for (int j = 0; j < numBodies; j++)
+    {
+        for (int k = j + 1; k < numBodies; k++)
+        {
+            updateVelocityPair(&bodies[j], &bodies[k], dt);
+        }
+    }
+#else
+    for (int j = 0; j < numBodies; j++)
+    {
+        for (int k = 0; k < numBodies; k++)
+        {
+            if (j != k)
+            {
+                updateVelocity(&bodies[j], &bodies[k], dt);
+            }
+        }
+    }
+#endif
+}
+
 void runSimulationNoAcc(struct CelestialBody *bodies, float dt, int numIterations, int numBodies)
 {
+#if LEAPFROG
+    // Kick-drift-kick: the velocities move half a step ahead of the positions, and get back with the last half step
+    updateVelocities(bodies, 0.5f * dt, numBodies);
+#endif
     for (int i = 0; i < numIterations; i++)
     {
         for (int j = 0; j < numBodies; j++)
@@ -544,16 +794,11 @@ void runSimulationNoAcc(struct CelestialBody *bodies, float dt, int numIteration
             updatePosition(&bodies[j], dt);
         }
 
-        for (int j = 0; j < numBodies; j++)
-        {
-            for (int k = 0; k < numBodies; k++)
-            {
-                if (j != k)
-                {
-                    updateVelocity(&bodies[j], &bodies[k], dt);
-                }
-            }
-        }
+#if LEAPFROG
+        updateVelocities(bodies, i == numIterations - 1 ? 0.5f * dt : dt, numBodies);
+#else
+        updateVelocities(bodies, dt, numBodies);
+#endif
     }
 }
 
@@ -623,53 +868,50 @@ void simulateNoAcc(struct CelestialBody *bodies)
 #if RISCV
 #pragma region Simulation with acceleration
 
-float scaledMass(float mass)
-{
-    float G = 6.67430e-11f;
-    return mass * G * 1e-18f;
-}
+// The accelerator works on the distances in units of 2^20 m (about 1000 km), and on G * m in the same units,
+// so that the solar system stays far from the limits of the floats
+#define DISTANCE_SCALE          -20
 
-float scaledSize(float size)
+void setupScales(uint32_t lock)
 {
-    return size * 1e-6f;
-}
-float scaledDistance(float distance)
-{
-    return distance * 1e-6f;
+    // Set once per simulation, the records are then sent and read back in SI units without any scaling on the core
+    setDistanceScale(DISTANCE_SCALE, lock);
+    setGravity(6.67430e-11f, lock);
 }
 
 void setupCelestialBody(struct CelestialBody *body, uint32_t targetBPE, uint32_t lock)
 {
-    // Set the mass and size
-    setMass(scaledMass(body->mass), lock);
-    setSize(scaledSize(body->size), lock);
-
-    // Send the position
-    sendPosition(scaledDistance(body->x), scaledDistance(body->y), scaledDistance(body->z), targetBPE, lock);
-
-    // Send the velocity
-    sendVelocity(scaledDistance(body->vx), scaledDistance(body->vy), scaledDistance(body->vz), targetBPE, lock);
+    // 9 packets per body instead of setting every field and forwarding position and velocity separately
+    loadBody(body, targetBPE, lock);
 }
 
 void runSimlationAcc(uint32_t lock, int maxWait)
 {
-    startimulation(lock);
-    sendIdle(lock); // Otherwise the accelerator is stuck on startSimulation and will start it again in case it finishes before the C code notices
-    for (int i = 0; i < NUM_BODIES-1; i++) { // Ensure we don't check if the iteration is 0 before the first iteration 
-        // is completed
-        sendIdle(lock);
-    }
+    // Interrupt once the run is over, or stopped by a collision. No keep alive is needed while it runs
+    setConfig(CFG_IRQ_CLEAR, IRQ_DONE | IRQ_COLLISION | IRQ_TICK, lock);
+    setConfig(CFG_IRQ_ENABLE, IRQ_DONE | IRQ_COLLISION, lock);
+    enableCelestialInterrupt();
+
+    startimulation(lock); // Executed once by the command queue, no idle padding needed
 
     int currentWait = 0;
-    while (currentWait < maxWait) {       
-        if (getIteration(lock) == 0) {
+    while (currentWait < maxWait) {
+        if (reg_read32(CELESTIAL_LOCKED) & (CELESTIAL_STATUS_IRQ_DONE | CELESTIAL_STATUS_IRQ_COLLISION)) {
             // Simulation finished
             break;
         }
+        // Sleep until the accelerator raises its interrupt
+        asm volatile ("wfi");
         currentWait++;
-        sendKeepAlive(lock);
-        sendIdle(lock);
-    }   
+    }
+
+    // Acknowledge the interrupt, in the accelerator then in the PLIC
+    uint32_t claimed = reg_read32(PLIC_CLAIM_HART0);
+    setConfig(CFG_IRQ_CLEAR, IRQ_DONE | IRQ_COLLISION | IRQ_TICK, lock);
+    setConfig(CFG_IRQ_ENABLE, 0, lock);
+    if (claimed != 0) {
+        reg_write32(PLIC_CLAIM_HART0, claimed);
+    }
 }
 
 void simulateAcc(struct CelestialBody *bodiesWithoutAcc)
@@ -705,6 +947,10 @@ void simulateAcc(struct CelestialBody *bodiesWithoutAcc)
     setMaxIterations(numIterations, lock);
     // Set the active BPEs
     setActiveBPEs(activeBPEs, lock);
+    // Units of the accelerator
+    setupScales(lock);
+    // Same integrator as the simulation without the accelerator
+    setConfig(CFG_LEAPFROG, LEAPFROG, lock);
     // Send the planets to the accelerator
     for (int i = 0; i < NUM_BODIES; i++) {
         setupCelestialBody(&bodies[i], i, lock);
@@ -757,14 +1003,14 @@ void simulateAcc(struct CelestialBody *bodiesWithoutAcc)
 
 #if NUM_BODIES < 5 // Don't check if used random planets
 
-    errorSum += checkPositionError(posEarthX, scaledDistance(bodiesWithoutAcc[1].x), "Earth X - acc vs no acc");
-    errorSum += checkPositionError(posEarthY, scaledDistance(bodiesWithoutAcc[1].y), "Earth Y - acc vs no acc");
-    errorSum += checkPositionError(posEarthZ, scaledDistance(bodiesWithoutAcc[1].z), "Earth Z - acc vs no acc");
+    errorSum += checkPositionError(posEarthX, bodiesWithoutAcc[1].x, "Earth X - acc vs no acc");
+    errorSum += checkPositionError(posEarthY, bodiesWithoutAcc[1].y, "Earth Y - acc vs no acc");
+    errorSum += checkPositionError(posEarthZ, bodiesWithoutAcc[1].z, "Earth Z - acc vs no acc");
     #if NUM_BODIES > 2
-    errorSum += checkPositionError(posMoonX, scaledDistance(bodiesWithoutAcc[2].x), "Moon X - acc vs no acc");
-    errorSum += checkPositionError(posMoonY, scaledDistance(bodiesWithoutAcc[2].y), "Moon Y - acc vs no acc");
+    errorSum += checkPositionError(posMoonX, bodiesWithoutAcc[2].x, "Moon X - acc vs no acc");
+    errorSum += checkPositionError(posMoonY, bodiesWithoutAcc[2].y, "Moon Y - acc vs no acc");
      // Slightly more tolerance as low number at the start, thus variation is higher in %age
-    errorSum += checkPositionErrorCustomTol(posMoonZ, scaledDistance(bodiesWithoutAcc[2].z), "Moon Z - acc vs no acc", 0.3f);
+    errorSum += checkPositionErrorCustomTol(posMoonZ, bodiesWithoutAcc[2].z, "Moon Z - acc vs no acc", 0.3f);
     #endif
     if (errorSum > 0)
     {
@@ -0,0 +1,19 @@
+package chipyard.example
+
+import org.scalatest.flatspec.AnyFlatSpec
+import org.chipsalliance.cde.config.Config
+import freechips.rocketchip.diplomacy.LazyModule
+
+// Rocket SoC with the accelerator in its own clock domain
+class CelestialClockDomainConfig extends Config(
+  new WithCelestial(clockFreqMHz = Some(500.0)) ++
+  new chipyard.RocketConfig)
+
+// Elaborating the SoC resolves the clock groups and the crossings of the accelerator's clock domain
+class CelestialElaborationTest extends AnyFlatSpec {
+  "WithCelestial" should "elaborate in its own clock domain" in {
+    val chirrtl = circt.stage.ChiselStage.emitCHIRRTL(LazyModule(new chipyard.ChipTop()(new CelestialClockDomainConfig)).module)
+    assert(chirrtl.contains("AsyncQueueSink"), "The register node isn't behind an async crossing")
+    assert(chirrtl.contains("celestial_locked"), "The locked status isn't at the top")
+  }
+}
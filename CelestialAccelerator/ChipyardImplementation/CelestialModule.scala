@@ -1,12 +1,28 @@
-class CelestialTopIO extends Bundle {
+trait CelestialTopIO extends Bundle {
+  val params: CelestialParams
+
   val dOut = Output(UInt(32.W))
-  val locked = Output(Bool())
+  val locked = Output(Bool()) // At least one partition is locked
   val currentIteration = Output(UInt(32.W))
   val dIn = Input(UInt(64.W))
+  val dma = Vec(params.partitions, new CelestialDMAIO(params.precision.words)) // One DMA engine per partition
 }
 
 case class CelestialParams(
-  BPE_num: Int
+  BPE_num: Int,
+  recordDepth: Int = 1024, // Words in the trajectory recorder's ring buffer
+  cmdQueueDepth: Int = 8, // Packets waiting to be executed
+  bodiesPerBPU: Int = 1, // Records held by each BPU, the accelerator simulates up to BPE_num * bodiesPerBPU bodies
+  partitions: Int = 1, // Independent groups of BPE_num / partitions BPUs, each one with its own lock and registers
+  pipelinedBPU: Boolean = false, // Dedicated arithmetic units for the velocity update, a new body is broadcast every cycle
+  bpuLanes: Int = 1, // Arithmetic units per BPU, 3 to compute the x, y and z components together
+  symmetricPairs: Boolean = false, // Each pair of bodies is computed once, the BPUs send the reaction back
+  ringInterconnect: Boolean = false, // The bodies travel around a ring of BPUs instead of being broadcast on a bus
+  switchClusterSize: Int = 0, // BPUs per cluster of the broadcast tree, 0 for a single bus
+  clockFreqMHz: Option[Double] = None, // Own clock for the accelerator, crossed to the buses, instead of the pbus clock
+  tableSeed: Boolean = false, // x^(-3/2) from a table of polynomials, the Newton-Raphson passes are then off by default
+  unitStages: Int = 0, // Register stages of the BPUs' multipliers and fused multiply-add units, for a higher clock
+  precision: FloatFormat = FloatFormat.F32 // Format of the BPUs' records, FloatFormat.F64 sends each value as two words
 )
 
 trait CelestialModule extends HasRegMap {
@@ -16,54 +32,237 @@ trait CelestialModule extends HasRegMap {
   def params: CelestialParams
   val clock: Clock
 
-  val dIn = Reg(UInt(64.W))
-  val dOut = Wire(UInt(32.W))
-  val locked = Wire(Bool())
-  val currentIteration = Wire(UInt(32.W))
-
-  val impl = Module(new CelestialTop(params.BPE_num))
-  impl.io.dIn := dIn
-
-  dOut := impl.io.dOut
-  locked := impl.io.locked
-  currentIteration := impl.io.currentIteration
-
-  val status = Cat(locked, 0.U(31.W))
-
-  regmap(
-    0x00 -> Seq(
-      RegField.r(32, status)),
-    0x04 -> Seq(
-      RegField.w(64, dIn)),
-    0x0C -> Seq(
-      RegField.r(32, dOut)),
-    0x10 -> Seq(
-      RegField.r(32, currentIteration))
-  )
+  require(params.BPE_num % params.partitions == 0, "The BPUs must be split evenly between the partitions")
+
+  // Each partition is a full accelerator, with its own lock key, dt, iteration counter, sequencer and broadcast bus,
+  // so that several small simulations can run at the same time. Its registers start at partition * CelestialTop.partitionStride
+  val partitions = for (i <- 0 until params.partitions) yield {
+    // Each write in dIn enqueues exactly one packet, which the top module executes once
+    val cmdQueue = Module(new Queue(UInt(64.W), params.cmdQueueDepth))
+    cmdQueue.io.enq.valid := false.B
+    cmdQueue.io.enq.bits := 0.U
+    val queueFull = !cmdQueue.io.enq.ready
+
+    val impl = Module(new CelestialTop(params.BPE_num / params.partitions, params.recordDepth, params.bodiesPerBPU, params.pipelinedBPU,
+      params.bpuLanes, params.symmetricPairs, params.ringInterconnect, params.switchClusterSize, params.tableSeed,
+      params.unitStages, params.precision))
+    impl.io.dIn <> cmdQueue.io.deq
+
+    io.dma(i) <> impl.io.dma
+    interrupts(i) := impl.io.interrupt
+
+    val status = Cat(impl.io.locked, impl.io.dmaBusy, impl.io.irqPending, queueFull, 0.U(26.W))
+    val base = CelestialTop.partitionBase(i)
+
+    (impl, Seq(
+      (base + CelestialTop.statusReg) -> Seq(
+        RegField.r(32, status)),
+      (base + CelestialTop.dInReg) -> Seq(
+        RegField.w(64, RegWriteFn((valid, data) => {
+          cmdQueue.io.enq.valid := valid
+          cmdQueue.io.enq.bits := data
+          cmdQueue.io.enq.ready // The write waits while the queue is full
+        }))),
+      (base + CelestialTop.dOutReg) -> Seq(
+        // Only answer once every packet sent before was executed, so the output matches the last output command
+        RegField.r(32, RegReadFn(ready => (cmdQueue.io.count === 0.U, impl.io.dOut)))),
+      (base + CelestialTop.iterationReg) -> Seq(
+        RegField.r(32, impl.io.currentIteration)),
+      (base + CelestialTop.recordHeadReg) -> Seq(
+        RegField.r(32, impl.io.recordHead)),
+      (base + CelestialTop.recordTailReg) -> Seq(
+        RegField.r(32, impl.io.recordTail)),
+      (base + CelestialTop.recordDroppedReg) -> Seq(
+        RegField.r(32, impl.io.recordDropped))
+    ))
+  }
+
+  io.locked := partitions.map(_._1.io.locked).reduce(_ || _)
+
+  regmap(partitions.flatMap(_._2): _*)
 }
 
 class CelestialTL(params: CelestialParams, beatBytes: Int)(implicit p: Parameters)
   extends TLRegisterRouter(
     params.address, "celestial", Seq("ucbbar,celestial"),
-    beatBytes = beatBytes)(
+    beatBytes = beatBytes, interrupts = params.partitions)(
       new TLRegBundle(params, _) with CelestialTopIO)(
       new TLRegModule(params, _, _) with CelestialModule)
 
 
+// Moves arrays of CelestialBody records between the memory and the accelerator, one record (32 bytes) per TileLink burst.
+// The array must be 32 bytes aligned. With words per value, the records are words times larger, e.g. 64 bytes of doubles.
+class CelestialDMA(beatBytes: Int, words: Int = 1)(implicit p: Parameters) extends LazyModule {
+  val node = TLClientNode(Seq(TLMasterPortParameters.v1(Seq(TLMasterParameters.v1(
+    name = "celestial-dma", sourceId = IdRange(0, 1))))))
+
+  lazy val module = new LazyModuleImp(this) {
+    val io = IO(Flipped(new CelestialDMAIO(words)))
+    val (mem, edge) = node.out(0)
+
+    val recordBytes = 32 * words
+    val recordWords = 8 * words
+    val wordsPerBeat = beatBytes / 4
+    val beatsPerRecord = recordBytes / beatBytes
+    require(beatBytes >= 4 && beatBytes <= recordBytes, "The DMA expects a bus between 4 and 32 bytes wide")
+
+    val s_idle :: s_load_req :: s_load_resp :: s_store_read :: s_store_put :: s_store_ack :: Nil = Enum(6)
+    val state = RegInit(s_idle)
+
+    val addr = Reg(UInt(64.W))
+    val count = Reg(UInt(32.W))
+    val body = RegInit(0.U(32.W))
+    val word = RegInit(0.U(log2Ceil(recordWords).W)) // Word of the record currently transferred
+    val beat = RegInit(0.U(log2Ceil(beatsPerRecord + 1).W))
+    val record = Reg(Vec(recordWords, UInt(32.W))) // Words read from the accelerator, when storing
+
+    // Delayed by one cycle, so that the accelerator can still commit the last record before leaving its DMA state
+    val done = WireDefault(false.B)
+    io.done := RegNext(done, false.B)
+    io.body := body
+    io.word := word
+    io.loadValid := false.B
+    if (wordsPerBeat == 1) {
+      io.loadData := mem.d.bits.data(31, 0)
+    } else {
+      io.loadData := (mem.d.bits.data >> (word(log2Ceil(wordsPerBeat) - 1, 0) * 32.U))(31, 0)
+    }
+
+    mem.a.valid := false.B
+    mem.a.bits := DontCare
+    mem.d.ready := false.B
+
+    val recordSize = log2Ceil(recordBytes).U
+    val beatData = Cat((0 until wordsPerBeat).reverse.map(i => record(beat * wordsPerBeat.U + i.U)))
+
+    // Move to the next body, or finish
+    def nextBody(): Unit = {
+      body := body + 1.U
+      addr := addr + recordBytes.U
+      word := 0.U
+      beat := 0.U
+      when (body + 1.U === count) {
+        done := true.B
+        state := s_idle
+      } .otherwise {
+        state := Mux(state === s_load_resp, s_load_req, s_store_read)
+      }
+    }
+
+    switch (state) {
+      is (s_idle) {
+        when (io.start) {
+          addr := io.addr
+          count := io.count
+          body := 0.U
+          word := 0.U
+          beat := 0.U
+          when (io.count === 0.U) {
+            done := true.B
+          } .otherwise {
+            state := Mux(io.store, s_store_read, s_load_req)
+          }
+        }
+      }
+      is (s_load_req) {
+        mem.a.valid := true.B
+        mem.a.bits := edge.Get(0.U, addr, recordSize)._2
+        when (mem.a.fire) {
+          state := s_load_resp
+        }
+      }
+      is (s_load_resp) {
+        // Hand the words of each beat to the accelerator one per cycle, the beat is only consumed with its last word
+        io.loadValid := mem.d.valid
+        val lastWordOfBeat = if (wordsPerBeat == 1) true.B else word(log2Ceil(wordsPerBeat) - 1, 0) === (wordsPerBeat - 1).U
+        mem.d.ready := lastWordOfBeat
+        when (mem.d.valid) {
+          word := word + 1.U
+          when (word === (recordWords - 1).U) {
+            nextBody()
+          }
+        }
+      }
+      is (s_store_read) {
+        // The accelerator outputs one word of the record per cycle
+        record(word) := io.storeData
+        word := word + 1.U
+        when (word === (recordWords - 1).U) {
+          state := s_store_put
+        }
+      }
+      is (s_store_put) {
+        mem.a.valid := true.B
+        mem.a.bits := edge.Put(0.U, addr, recordSize, beatData)._2
+        when (mem.a.fire) {
+          beat := beat + 1.U
+          when (beat === (beatsPerRecord - 1).U) {
+            state := s_store_ack
+          }
+        }
+      }
+      is (s_store_ack) {
+        mem.d.ready := true.B
+        when (mem.d.fire) {
+          nextBody()
+        }
+      }
+    }
+  }
+}
+
 trait CanHavePeripheryCelestial { this: BaseSubsystem =>
   private val portName = "celestial"
 
   val celestial_locked = p(CelestialKey) match {
     case Some(params) => {
-      val celestial = pbus {
+      // With clockFreqMHz, the register node, the BPUs and the DMA engines run in their own clock domain, so that the
+      // simulation runs at the frequency the datapath closes timing at. The TileLink ports and the interrupts cross
+      // to the buses through async FIFOs
+      val celestialDomain = params.clockFreqMHz.map { freqMHz =>
+        val domain = LazyModule(new ClockSinkDomain(take = Some(ClockParameters(freqMHz)), name = Some("celestial")))
+        domain.clockNode := ClockGroup()(p, ValName("celestial_clock")) := asyncClockGroupsNode
+        domain
+      }
+      def inDomain[T](body: => T): T = celestialDomain match {
+        case Some(domain) => domain { body }
+        case None => pbus { body }
+      }
+
+      val celestial = inDomain {
         LazyModule(new CelestialTL(params, pbus.beatBytes)(p))
       }
-      pbus.coupleTo(portName) {
-        celestial.node :=
-          TLFragmenter(pbus.beatBytes, pbus.blockBytes) := _
+      pbus.coupleTo(portName) { bus =>
+        val fragmented = TLFragmenter(pbus.beatBytes, pbus.blockBytes) := bus
+        celestialDomain match {
+          case Some(domain) => celestial.node := domain { TLAsyncCrossingSink() } := TLAsyncCrossingSource() := fragmented
+          case None => celestial.node := fragmented
+        }
+      }
+
+      // The DMA engines sit next to the register node, and master the front bus. One per partition, so that they don't wait for each other
+      for (i <- 0 until params.partitions) {
+        val celestial_dma = inDomain {
+          LazyModule(new CelestialDMA(fbus.beatBytes, params.precision.words)(p))
+        }
+        fbus.coupleFrom(s"celestial-dma-$i") { bus =>
+          celestialDomain match {
+            case Some(domain) => bus := TLBuffer() := TLAsyncCrossingSink() := domain { TLAsyncCrossingSource() } := celestial_dma.node
+            case None => bus := TLBuffer() := celestial_dma.node
+          }
+        }
+        inDomain { InModuleBody {
+          celestial.module.io.dma(i) <> celestial_dma.module.io
+        }}
+      }
+
+      // Completion, collision and periodic interrupts, one line per partition, so the core doesn't have to poll
+      celestialDomain match {
+        case Some(domain) => ibus.fromAsync := domain { IntSyncCrossingSource() := celestial.intnode }
+        case None => ibus.fromSync := celestial.intnode
       }
 
-      val pbus_io = pbus { InModuleBody {
+      val pbus_io = inDomain { InModuleBody {
         val locked = IO(Output(Bool()))
         locked := celestial.module.io.locked
         locked
@@ -71,7 +270,8 @@ trait CanHavePeripheryCelestial { this: BaseSubsystem =>
 
       val top_locked = InModuleBody {
         val locked = IO(Output(Bool())).suggestName("celestial_locked")
-        locked := pbus_io
+        // From the accelerator's own clock domain, the status goes through a synchronizer like the interrupts
+        locked := (if (celestialDomain.isDefined) SynchronizerShiftReg(pbus_io.getWrappedValue, 3) else pbus_io.getWrappedValue)
         locked
       }
 
@@ -81,11 +281,26 @@ trait CanHavePeripheryCelestial { this: BaseSubsystem =>
   }
 }
 
-class WithCelestial(BPE_num: Int = 4) extends Config((site, here, up) => {
+class WithCelestial(BPE_num: Int = 4, bodiesPerBPU: Int = 1, partitions: Int = 1, pipelinedBPU: Boolean = false,
+                    bpuLanes: Int = 1, symmetricPairs: Boolean = false,
+                    ringInterconnect: Boolean = false, switchClusterSize: Int = 0,
+                    clockFreqMHz: Option[Double] = None, tableSeed: Boolean = false,
+                    unitStages: Int = 0, precision: FloatFormat = FloatFormat.F32) extends Config((site, here, up) => {
   case CelestialKey => {
     Some(CelestialParams(
       address = 0x4000,
-      BPE_num = BPE_num
+      BPE_num = BPE_num,
+      bodiesPerBPU = bodiesPerBPU,
+      partitions = partitions,
+      pipelinedBPU = pipelinedBPU,
+      bpuLanes = bpuLanes,
+      symmetricPairs = symmetricPairs,
+      ringInterconnect = ringInterconnect,
+      switchClusterSize = switchClusterSize,
+      clockFreqMHz = clockFreqMHz,
+      tableSeed = tableSeed,
+      unitStages = unitStages,
+      precision = precision
     ))
   }
 })
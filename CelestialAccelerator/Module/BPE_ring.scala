@@ -0,0 +1,43 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// Ring interconnect: instead of broadcasting one body to all the BPUs, the records of a slot travel around a ring of
+// BPUs, one hop per broadcast step, so that every BPU updates its record with a different body at each step and the
+// wiring stays local to neighbouring BPUs.
+// The target is split the same way as a body index: its low bits are the hop k, and its high bits the slot t of the
+// travelling records. At hop k, BPU i updates its record with the record t of BPU i - k, so going through the hops
+// 0 to bpe_nbr - 1 of every slot covers all the pairs. The top module must go through the hops in order, as the
+// records only move by one BPU per step.
+class BPE_ring(bpe_nbr: Int, bodies_per_bpu: Int = 1, pipelined: Boolean = false, lanes: Int = 1, table_seed: Boolean = false,
+               unit_stages: Int = 0, format: FloatFormat = FloatFormat.F32)
+    extends BPE_interconnect(bpe_nbr, bodies_per_bpu, pipelined, lanes, symmetric = false, table_seed = table_seed,
+        unit_stages = unit_stages, format = format) {
+    require(bpe_nbr >= 2 && isPow2(bpe_nbr), "The ring needs a power of 2 number of BPUs")
+
+    val hop = target_bpu
+    val records = (0 until bpe_nbr).map(outputRecord)
+
+    // ring(i) holds the record of BPU i - ring_hop
+    val ring = Reg(Vec(bpe_nbr, new BodySource(width)))
+    val ring_hop = RegInit(0.U(bpu_width.W))
+
+    for (i <- 0 until bpe_nbr) {
+        val previous = (i + bpe_nbr - 1) % bpe_nbr
+        // Hop 0 is the BPU's own record, the next hop is the record held by the previous BPU
+        val record = Mux(hop === 0.U, records(i), Mux(hop === ring_hop, ring(i), ring(previous)))
+        source(i) := record
+        when (io.m_slct === 0.U) {
+            ring(i) := record
+        }
+
+        // The BPU doesn't update a record with itself, nor with the inactive or absorbed bodies
+        val source_body = Cat(target_slot, (i.U(bpu_width.W) - hop)(bpu_width - 1, 0))
+        source_id(i) := source_body(id_width - 1, 0)
+        receive(i) := !(hop === 0.U && target_slot === io.slot) && source_body < io.active && !io.absorbed(source_id(i))
+    }
+    when (io.m_slct === 0.U) {
+        ring_hop := hop
+    }
+}
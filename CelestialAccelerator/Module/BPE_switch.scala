@@ -4,27 +4,75 @@ import chisel3._
 import chisel3.util._
 import chisel3.experimental._
 
-class BPE_switch(val bpe_nbr: Int) extends Module {
+// Record of the body used by a BPU to update its velocity, with values of the given width
+class BodySource(width: Int = 32) extends Bundle {
+  val X = UInt(width.W)
+  val Y = UInt(width.W)
+  val Z = UInt(width.W)
+  val m = UInt(width.W)
+  val size = UInt(width.W)
+}
+
+// The BPUs and the routing of the commands to them, common to all the interconnects. The interconnect only decides
+// which body each BPU uses during the velocity update, by driving source and receive.
+// When the interconnect is registered, source arrives broadcast_latency cycles after the target, so the velocity
+// update reaches the BPUs that much later. With cluster_size, the collisions are reduced per cluster of BPUs first.
+// The values on the buses are floats of the BPUs' format.
+abstract class BPE_interconnect(val bpe_nbr: Int, val bodies_per_bpu: Int, val pipelined: Boolean, val lanes: Int,
+                                val symmetric: Boolean, val cluster_size: Int = 0, val broadcast_latency: Int = 0,
+                                val table_seed: Boolean = false, val unit_stages: Int = 0,
+                                val format: FloatFormat = FloatFormat.F32) extends Module {
+  require(bodies_per_bpu == 1 || isPow2(bpe_nbr), "The number of BPUs must be a power of 2 to hold several bodies per BPU")
+
+  val bpu_width = log2Ceil(bpe_nbr)
+  val slot_width = log2Ceil(bodies_per_bpu).max(1)
+  val id_width = log2Ceil(bpe_nbr * bodies_per_bpu)
+  val width = format.width
+
   val io = IO(new Bundle {
-    // Target has to be log2(bpe) bits
-    val target = Input(UInt(log2Ceil(bpe_nbr).W))
-    val X_in = Input(UInt(32.W))
-    val Y_in = Input(UInt(32.W))
-    val Z_in = Input(UInt(32.W))
+    // Target is a body index, so it has to be log2(bpe * bodies per bpe) bits
+    val target = Input(UInt(log2Ceil(bpe_nbr * bodies_per_bpu).W))
+    // Record updated by all the BPUs, when updating the velocity or the position
+    val slot = Input(UInt(slot_width.W))
+    val sync = Input(Bool()) // First cycle of an update, restarts the BPUs' counters
+    val X_in = Input(UInt(width.W))
+    val Y_in = Input(UInt(width.W))
+    val Z_in = Input(UInt(width.W))
+
+    val size_in = Input(UInt(width.W))
+    val m_in = Input(UInt(width.W))
 
-    val size_in = Input(UInt(32.W))
-    val m_in = Input(UInt(32.W))
+    // Velocity, only used when loading a full body at once
+    val VX_in = Input(UInt(width.W))
+    val VY_in = Input(UInt(width.W))
+    val VZ_in = Input(UInt(width.W))
 
-    val m_slct = Input(UInt(3.W))
+    val m_slct = Input(UInt(4.W))
 
-    val dt = Input(UInt(32.W))
+    val dt = Input(UInt(width.W))
 
-    val X_out = Output(UInt(32.W))
-    val Y_out = Output(UInt(32.W))
-    val Z_out = Output(UInt(32.W))
+    val X_out = Output(UInt(width.W))
+    val Y_out = Output(UInt(width.W))
+    val Z_out = Output(UInt(width.W))
+    val m_out = Output(UInt(width.W))
+    val size_out = Output(UInt(width.W))
 
     val collided = Output(Bool())
-    val collision_id = Output(UInt(log2Ceil(bpe_nbr).W))
+    val collision_id = Output(UInt(log2Ceil(bpe_nbr * bodies_per_bpu).W))
+    val collision_partner = Output(UInt(log2Ceil(bpe_nbr * bodies_per_bpu).W)) // Body that collision_id collided with
+    // Collision register of the target's BPU, whether it holds the target and the body it collided with
+    val target_collided = Output(Bool())
+    val target_partner = Output(UInt(log2Ceil(bpe_nbr * bodies_per_bpu).W))
+    val busy = Output(Bool()) // The BPUs are clearing their records, after a reset
+    val pipeline_busy = Output(Bool()) // Pipelined BPUs only, velocity updates are still in flight
+    val active = Input(UInt(log2Ceil(bpe_nbr * bodies_per_bpu + 1).W)) // Number of active bodies
+    val refinements = Input(UInt(BPU.refinementsWidth(format).W)) // Newton-Raphson passes of the velocity update
+    // Block timesteps: the velocity update only changes the bodies that are due, and each of them uses
+    // dt / 2^level, where level is its own timestep level
+    val due = Input(Vec(bpe_nbr * bodies_per_bpu, Bool()))
+    val level = Input(Vec(bpe_nbr * bodies_per_bpu, UInt(BPE_interconnect.levelWidth.W)))
+    // Bodies merged into another one by a collision, the BPUs don't use them during the velocity update anymore
+    val absorbed = Input(Vec(bpe_nbr * bodies_per_bpu, Bool()))
   })
 
 // For debugging purposes, we can print the binary representation of a UInt
@@ -37,24 +85,132 @@ class BPE_switch(val bpe_nbr: Int) extends Module {
   }
   
     val BPUs_io = for (i <- 0 until bpe_nbr) yield {
-        val bpu = Module(new BPU())
+        val bpu = Module(new BPU(bodies_per_bpu, pipelined, lanes, symmetric, table_seed, unit_stages, format))
         bpu.io
     }
 
-    val X_broadcast = WireDefault(0.U(32.W))
-    val Y_broadcast = WireDefault(0.U(32.W))
-    val Z_broadcast = WireDefault(0.U(32.W))
+    // Body v is held in the record v / bpe_nbr of the BPU v % bpe_nbr, so that the bodies are spread over all the BPUs
+    val target_bpu = io.target(bpu_width - 1, 0)
+    val target_slot = if (bodies_per_bpu == 1) 0.U(slot_width.W) else io.target >> bpu_width
 
-    val mass_broadcast = WireDefault(0.U(32.W))
-    val size_broadcast = WireDefault(0.U(32.W))
+    // Body used by each BPU during the velocity update, its index, and whether the BPU updates its record with it
+    val source = Wire(Vec(bpe_nbr, new BodySource(width)))
+    val source_id = Wire(Vec(bpe_nbr, UInt(id_width.W)))
+    val receive = Wire(Vec(bpe_nbr, Bool()))
+
+    // Record driven by the outputs of a BPU, the one selected by out_slot
+    def outputRecord(i: Int): BodySource = {
+        val record = Wire(new BodySource(width))
+        record.X := BPUs_io(i).X_out
+        record.Y := BPUs_io(i).Y_out
+        record.Z := BPUs_io(i).Z_out
+        record.m := BPUs_io(i).m_out
+        record.size := BPUs_io(i).size_out
+        record
+    }
 
     io.X_out := 0.U
     io.Y_out := 0.U
     io.Z_out := 0.U
+    io.m_out := 0.U
+    io.size_out := 0.U
 
-    io.collision_id := PriorityEncoder(BPUs_io.map(_.collided))
-    // Output 1 if any BPU has a collision
-    io.collided := BPUs_io.map(_.collided).reduce(_ || _)
+    // First BPU that collided in a group, the record that collided in it, and the body it collided with
+    def firstCollision(bpus: Seq[Int]): (UInt, UInt, UInt) = {
+        val first = PriorityEncoder(bpus.map(BPUs_io(_).collided))
+        (first, VecInit(bpus.map(BPUs_io(_).collided_slot))(first),
+            VecInit(bpus.map(BPUs_io(_).collided_source(id_width - 1, 0)))(first))
+    }
+    if (cluster_size == 0) {
+        val (collided_bpu, collided_slot, collided_source) = firstCollision(0 until bpe_nbr)
+        if (bodies_per_bpu == 1) {
+            io.collision_id := collided_bpu
+        } else {
+            io.collision_id := Cat(collided_slot, collided_bpu)
+        }
+        io.collision_partner := collided_source
+        // Output 1 if any BPU has a collision
+        io.collided := BPUs_io.map(_.collided).reduce(_ || _)
+    } else {
+        // Each cluster finds its first collision, then the first cluster that collided is selected,
+        // with a register after each level, so the collision is seen two cycles later
+        val clusters = (0 until bpe_nbr).grouped(cluster_size).toSeq
+        val cluster_collided = RegNext(VecInit(clusters.map(_.map(BPUs_io(_).collided).reduce(_ || _))),
+            VecInit(Seq.fill(clusters.length)(false.B)))
+        val cluster_first = RegNext(VecInit(clusters.map(firstCollision(_)._1)))
+        val cluster_slot = RegNext(VecInit(clusters.map(firstCollision(_)._2)))
+        val cluster_source = RegNext(VecInit(clusters.map(firstCollision(_)._3)))
+        val collided_cluster = PriorityEncoder(cluster_collided)
+        val collided_bpu = Cat(collided_cluster, cluster_first(collided_cluster))(bpu_width - 1, 0)
+        if (bodies_per_bpu == 1) {
+            io.collision_id := RegNext(collided_bpu)
+        } else {
+            io.collision_id := RegNext(Cat(cluster_slot(collided_cluster), collided_bpu))
+        }
+        io.collision_partner := RegNext(cluster_source(collided_cluster))
+        io.collided := RegNext(cluster_collided.asUInt.orR, false.B)
+    }
+    io.busy := BPUs_io.map(_.busy).reduce(_ || _)
+    io.target_collided := VecInit(BPUs_io.map(bpu => bpu.collided && bpu.collided_slot === target_slot))(target_bpu)
+    io.target_partner := VecInit(BPUs_io.map(_.collided_source(id_width - 1, 0)))(target_bpu)
+
+    // Velocity update as seen by the BPUs, delayed like the body coming from the interconnect
+    val velocity_stages = Seq.iterate(io.m_slct === 0.U, broadcast_latency + 1)(RegNext(_, false.B))
+    val velocity_valid = velocity_stages.last
+    val velocity_target = ShiftRegister(io.target, broadcast_latency)
+    val velocity_slot = ShiftRegister(io.slot, broadcast_latency)
+    val velocity_sync = ShiftRegister(io.sync, broadcast_latency)
+    val velocity_dt = ShiftRegister(io.dt, broadcast_latency)
+    val velocity_receive = ShiftRegister(receive, broadcast_latency)
+    val velocity_source = ShiftRegister(source_id, broadcast_latency)
+    // Body held by BPU i in the given record
+    def bodyOf(i: Int, slot: UInt): UInt = {
+        if (bodies_per_bpu == 1) i.U else if (bpe_nbr == 1) slot else Cat(slot, i.U(bpu_width.W))
+    }
+    val velocity_due = ShiftRegister(VecInit((0 until bpe_nbr).map(i => io.due(bodyOf(i, io.slot)))), broadcast_latency)
+    val velocity_level = ShiftRegister(VecInit((0 until bpe_nbr).map(i => io.level(bodyOf(i, io.slot)))), broadcast_latency)
+
+    // Symmetric pairs: the reactions of the bodies updated in the same cycle are summed, then added to the bank of
+    // the body that was broadcast when they started, which is the target a fixed number of cycles ago, for the
+    // number of refinement passes selected
+    val reaction_source = if (symmetric) {
+        VecInit(BPU.refinementPasses(format).map(passes => ShiftRegister(velocity_target,
+            BPU.reactionLatency(pipelined, lanes, passes, table_seed, unit_stages, format, bpe_nbr))))(io.refinements)
+    } else {
+        velocity_target
+    }
+    val reaction_bpu = reaction_source(bpu_width - 1, 0)
+    val reaction_slot = if (bodies_per_bpu == 1) 0.U(slot_width.W) else reaction_source >> bpu_width
+    // The sums go through the registered levels of the tree
+    val reaction_stages = Seq.iterate(BPUs_io.map(_.reaction_valid).reduce(_ || _),
+        BPU.reactionSumLatency(bpe_nbr, unit_stages) + 1)(RegNext(_, false.B))
+    val reaction_valid = reaction_stages.last
+    // Each level of the tree is registered, a value left without a pair waits for the adders of its level
+    def sumTree(values: Seq[UInt]): UInt = {
+        if (values.length == 1) {
+            values.head
+        } else {
+            sumTree(values.grouped(2).map {
+                case Seq(a, b) =>
+                    val adder = Module(new FPAdder(format, unit_stages))
+                    adder.io.a := a
+                    adder.io.b := b
+                    adder.io.substracter := false.B
+                    RegNext(adder.io.sum)
+                case Seq(a) =>
+                    ShiftRegister(a, unit_stages + 1)
+            }.toSeq)
+        }
+    }
+    val reaction_sum = if (symmetric) {
+        (0 until 3).map { axis =>
+            sumTree(BPUs_io.map(bpu => Mux(bpu.reaction_valid, Seq(bpu.reaction_X, bpu.reaction_Y, bpu.reaction_Z)(axis), 0.U)))
+        }
+    } else {
+        Seq.fill(3)(0.U(width.W))
+    }
+    // The velocity updates still in the interconnect, and their reactions still in the tree, count as in flight
+    io.pipeline_busy := (BPUs_io.map(_.pipeline_busy) ++ velocity_stages.drop(1) ++ reaction_stages.drop(1)).reduce(_ || _)
 
     for (i <- 0 until bpe_nbr) {
         // Default values
@@ -63,75 +219,175 @@ class BPE_switch(val bpe_nbr: Int) extends Module {
         BPUs_io(i).Z_in := 0.U
         BPUs_io(i).size_in := 0.U
         BPUs_io(i).m_in := 0.U
+        BPUs_io(i).VX_in := 0.U
+        BPUs_io(i).VY_in := 0.U
+        BPUs_io(i).VZ_in := 0.U
         BPUs_io(i).dt := 0.U
         BPUs_io(i).m_slct := 6.U // 6 = idle
+        BPUs_io(i).slot := io.slot
+        BPUs_io(i).out_slot := target_slot
+        BPUs_io(i).sync := io.sync
+        BPUs_io(i).source := velocity_source(i)
+        BPUs_io(i).refinements := io.refinements
+        BPUs_io(i).reaction_in_X := reaction_sum(0)
+        BPUs_io(i).reaction_in_Y := reaction_sum(1)
+        BPUs_io(i).reaction_in_Z := reaction_sum(2)
+        BPUs_io(i).reaction_in_valid := reaction_valid && reaction_bpu === i.U
+        BPUs_io(i).reaction_slot := reaction_slot
     
 
         switch(io.m_slct) {
-            is(0.U) { // 0 = update velocity
-                // -> Broadcast target BPU's coordinate to all other BPUs
-                when (io.target === i.U) {
-                    // Inputs can remain at default values
-                    X_broadcast := BPUs_io(i).X_out
-                    Y_broadcast := BPUs_io(i).Y_out
-                    Z_broadcast := BPUs_io(i).Z_out
-
-                    mass_broadcast := BPUs_io(i).m_out
-                    size_broadcast := BPUs_io(i).size_out
-                }.otherwise {
-                    BPUs_io(i).X_in := X_broadcast
-                    BPUs_io(i).Y_in := Y_broadcast
-                    BPUs_io(i).Z_in := Z_broadcast
-                    BPUs_io(i).m_in := mass_broadcast
-                    BPUs_io(i).size_in := size_broadcast
-                    BPUs_io(i).dt := io.dt
-                    BPUs_io(i).m_slct := 0.U // 0 = update velocity
-                }
+            is(0.U) { // 0 = update velocity, handled below once it went through the interconnect
             }
             is(1.U) { // 1 = update position
                 BPUs_io(i).dt := io.dt
                 BPUs_io(i).m_slct := 1.U // 1 = update position
             }
             is(2.U) { // 2 = set position
-                when (io.target === i.U) {
+                when (target_bpu === i.U) {
                     BPUs_io(i).X_in := io.X_in
                     BPUs_io(i).Y_in := io.Y_in
                     BPUs_io(i).Z_in := io.Z_in
                     BPUs_io(i).size_in := io.size_in
                     BPUs_io(i).m_in := io.m_in
+                    BPUs_io(i).slot := target_slot
                     BPUs_io(i).m_slct := 2.U // 2 = set position
                 }
             }
             is(3.U) { // 3 = set velocity
-                when (io.target === i.U) {
+                when (target_bpu === i.U) {
                     BPUs_io(i).X_in := io.X_in
                     BPUs_io(i).Y_in := io.Y_in
                     BPUs_io(i).Z_in := io.Z_in
+                    BPUs_io(i).slot := target_slot
                     BPUs_io(i).m_slct := 3.U // 3 = set velocity
                 }
             }
             is(4.U) { // 4 = output velocity of target
-                when (io.target === i.U) {
+                when (target_bpu === i.U) {
                     BPUs_io(i).m_slct := 4.U // 4 = output velocity
 
                     io.X_out := BPUs_io(i).X_out
                     io.Y_out := BPUs_io(i).Y_out
                     io.Z_out := BPUs_io(i).Z_out
+                    io.m_out := BPUs_io(i).m_out
+                    io.size_out := BPUs_io(i).size_out
                 }
             }
             is(5.U) { // 5 = reset all BPUs
                 BPUs_io(i).m_slct := 5.U 
             }
             is(6.U) { // 6 = output position of target
-                when (io.target === i.U) {
+                when (target_bpu === i.U) {
                     BPUs_io(i).m_slct := 6.U // 6 = do nothing, but still outputs position
 
                     io.X_out := BPUs_io(i).X_out
                     io.Y_out := BPUs_io(i).Y_out
                     io.Z_out := BPUs_io(i).Z_out
+                    io.m_out := BPUs_io(i).m_out
+                    io.size_out := BPUs_io(i).size_out
+                }
+            }
+            is(9.U) { // 9 = clear the collision of target
+                when (target_bpu === i.U) {
+                    BPUs_io(i).slot := target_slot
+                    BPUs_io(i).m_slct := 9.U
+                }
+            }
+            is(11.U) { // 11 = set the collision of target, with the body in X_in
+                when (target_bpu === i.U) {
+                    BPUs_io(i).X_in := io.X_in
+                    BPUs_io(i).slot := target_slot
+                    BPUs_io(i).m_slct := 11.U
+                }
+            }
+            is(10.U) { // 10 = output the reactions of target, with symmetric pairs
+                when (target_bpu === i.U) {
+                    BPUs_io(i).m_slct := 10.U
+
+                    io.X_out := BPUs_io(i).X_out
+                    io.Y_out := BPUs_io(i).Y_out
+                    io.Z_out := BPUs_io(i).Z_out
+                }
+            }
+            is(8.U) { // 8 = load full body: position, velocity, mass and size in one operation
+                when (target_bpu === i.U) {
+                    BPUs_io(i).X_in := io.X_in
+                    BPUs_io(i).Y_in := io.Y_in
+                    BPUs_io(i).Z_in := io.Z_in
+                    BPUs_io(i).VX_in := io.VX_in
+                    BPUs_io(i).VY_in := io.VY_in
+                    BPUs_io(i).VZ_in := io.VZ_in
+                    BPUs_io(i).size_in := io.size_in
+                    BPUs_io(i).m_in := io.m_in
+                    BPUs_io(i).slot := target_slot
+                    BPUs_io(i).m_slct := 8.U
                 }
             }
 
         }
+
+        // Update velocity, with the body given by the interconnect
+        when (velocity_valid) {
+            BPUs_io(i).slot := velocity_slot
+            BPUs_io(i).sync := velocity_sync
+            when (velocity_receive(i) && velocity_due(i)) {
+                BPUs_io(i).X_in := source(i).X
+                BPUs_io(i).Y_in := source(i).Y
+                BPUs_io(i).Z_in := source(i).Z
+                BPUs_io(i).m_in := source(i).m
+                BPUs_io(i).size_in := source(i).size
+                BPUs_io(i).dt := format.scale(velocity_dt, -velocity_level(i).zext)
+                BPUs_io(i).m_slct := 0.U // 0 = update velocity
+            }
+        }
+    }
+}
+
+object BPE_interconnect {
+    // Timestep levels 0 to 7, the smallest steps are dt / 128
+    val levelWidth = 3
+}
+
+// Broadcast bus: the target body's record is sent to every BPU.
+// With cluster_size, the bus is a tree: each cluster of BPUs selects the target among its own BPUs, then the clusters'
+// results are selected, and sent back to a register in each cluster, which drives its BPUs. The three levels are
+// registered, so the fan-out and the multiplexers stay the size of a cluster, at the cost of 3 cycles of latency.
+class BPE_switch(bpe_nbr: Int, bodies_per_bpu: Int = 1, pipelined: Boolean = false, lanes: Int = 1, symmetric: Boolean = false,
+                 cluster_size: Int = 0, table_seed: Boolean = false, unit_stages: Int = 0,
+                 format: FloatFormat = FloatFormat.F32)
+    extends BPE_interconnect(bpe_nbr, bodies_per_bpu, pipelined, lanes, symmetric, cluster_size, if (cluster_size == 0) 0 else 3,
+        table_seed, unit_stages, format) {
+    require(cluster_size == 0 || (isPow2(cluster_size) && cluster_size >= 2 && cluster_size < bpe_nbr && isPow2(bpe_nbr)),
+        "The clusters must split a power of 2 number of BPUs in groups of a power of 2 BPUs")
+
+    val records = (0 until bpe_nbr).map(outputRecord)
+    val broadcast = if (cluster_size == 0) {
+        val bus = WireDefault(0.U.asTypeOf(new BodySource(width)))
+        for (i <- 0 until bpe_nbr) {
+            when (target_bpu === i.U) {
+                bus := records(i)
+            }
+        }
+        Seq.fill(bpe_nbr)(bus)
+    } else {
+        val cluster_width = log2Ceil(cluster_size)
+        val local = target_bpu(cluster_width - 1, 0)
+        val cluster_records = RegNext(VecInit(records.grouped(cluster_size).map(group => VecInit(group)(local)).toSeq))
+        val selected = RegNext(cluster_records(RegNext(target_bpu >> cluster_width)))
+        val cluster_copies = Seq.fill(bpe_nbr / cluster_size)(RegNext(selected))
+        (0 until bpe_nbr).map(i => cluster_copies(i / cluster_size))
+    }
+
+    for (i <- 0 until bpe_nbr) {
+        source(i) := broadcast(i)
+        source_id(i) := io.target
+        // The target's BPU still updates its other records, as the outputs use a separate read port
+        // With symmetric pairs, only the bodies after the target are updated, the others get the reaction
+        receive(i) := (if (symmetric) {
+            io.slot * bpe_nbr.U + i.U > io.target
+        } else {
+            target_bpu =/= i.U || target_slot =/= io.slot
+        }) && !io.absorbed(io.target)
     }
-}
\ No newline at end of file
+}
@@ -4,12 +4,54 @@ import chisel3._
 import chisel3.util._
 import chisel3.experimental._
 
-class CelestialTop(val BPE_num: Int) extends Module {
+// Interface with the DMA engine, which moves arrays of CelestialBody records between the memory and the BPUs
+// The values of the records are words 32 bits words each, low word first
+class CelestialDMAIO(words: Int = 1) extends Bundle {
+  // Request, start is high for one cycle
+  val start = Output(Bool())
+  val store = Output(Bool()) // 0 = load the bodies from the memory, 1 = store them in the memory
+  val addr = Output(UInt(64.W))
+  val count = Output(UInt(32.W)) // Number of bodies to transfer
+
+  val done = Input(Bool()) // High for one cycle once the last body is transferred
+
+  // Word currently transferred: index of the body, and of the word in the record (X, Y, Z, dX, dY, dZ, mass, size)
+  val body = Input(UInt(32.W))
+  val word = Input(UInt(log2Ceil(8 * words).W))
+  val loadValid = Input(Bool()) // loadData holds a word read from the memory
+  val loadData = Input(UInt(32.W))
+  val storeData = Output(UInt(32.W)) // Requested word, when storing
+}
+
+class CelestialTop(val BPE_num: Int, val recordDepth: Int = 1024, val bodiesPerBPU: Int = 1, val pipelinedBPU: Boolean = false,
+                   val bpuLanes: Int = 1, val symmetricPairs: Boolean = false, val ringInterconnect: Boolean = false,
+                   val switchClusterSize: Int = 0, val tableSeed: Boolean = false, val unitStages: Int = 0,
+                   val format: FloatFormat = FloatFormat.F32) extends Module {
+  require(isPow2(recordDepth), "The trajectory recorder's depth must be a power of 2")
+  require(!(ringInterconnect && symmetricPairs), "The symmetric pairs need the broadcast bus")
+  require(!(ringInterconnect && switchClusterSize != 0), "The clusters are a part of the broadcast bus")
+
+  // Each BPU holds bodiesPerBPU records, and the bodies are time multiplexed over the BPUs
+  val body_num = BPE_num * bodiesPerBPU
+  // Values wider than 32 bits are sent to and read from the host one 32 bits word at a time, low word first
+  val width = format.width
+  val words = format.words
+  val word_width = log2Ceil(words).max(1)
+
   val io = IO(new Bundle {
   val dOut = Output(UInt(32.W))
   val locked = Output(Bool())
   val currentIteration = Output(UInt(32.W))
-  val dIn = Input(UInt(64.W))
+  val dIn = Flipped(Decoupled(UInt(64.W))) // Command queue, one packet is popped per cycle
+  val dma = new CelestialDMAIO(words)
+  val dmaBusy = Output(Bool())
+  val interrupt = Output(Bool())
+  // Bit 0 = max iteration reached or paused, bit 1 = collision, bit 2 = every K iterations
+  val irqPending = Output(UInt(3.W))
+  // Trajectory recorder's ring buffer, in words
+  val recordHead = Output(UInt(32.W))
+  val recordTail = Output(UInt(32.W))
+  val recordDropped = Output(UInt(32.W)) // Number of frames dropped because the buffer was full
   })
 
 // For debugging purposes, to print the binary representation of a UInt
@@ -20,56 +62,238 @@ class CelestialTop(val BPE_num: Int) extends Module {
     }
     result
   }
-  val bp_switch = Module(new BPE_switch(BPE_num))
+  val bp_switch: BPE_interconnect = if (ringInterconnect) {
+    Module(new BPE_ring(BPE_num, bodiesPerBPU, pipelinedBPU, bpuLanes, tableSeed, unitStages, format))
+  } else {
+    Module(new BPE_switch(BPE_num, bodiesPerBPU, pipelinedBPU, bpuLanes, symmetricPairs, switchClusterSize, tableSeed, unitStages,
+      format))
+  }
+
 
+  // Each packet is executed exactly once. When the queue is empty, the packet is seen as an idle command
+  val pckt = Mux(io.dIn.fire, io.dIn.bits, 0.U(64.W))
+  val command = pckt(63, 59) // 32 possible commands
+  val key = pckt(58, 32) // 27 bits for key
+  val data = pckt(31, 0) // 32 bits for data.
 
-  val command = io.dIn(63, 59) // 32 possible commands
-  val key = io.dIn(58, 32) // 27 bits for key
-  val data = io.dIn(31, 0) // 32 bits for data.
+  // Output commands are only executed for one cycle, so their result is held until the next one
+  val NaN = 0x7FC00000.U(32.W)
+  val dOut = RegInit(NaN)
+  io.dOut := dOut
 
   val lock_key = RegInit(0.U(27.W))
 
   val unlock_timeout = 100000.U(14.W) // Timeout for unlocking, in cycles
   val last_valid_pckt_received_cnt = RegInit(0.U(14.W))
 
-  val dt = RegInit(0.U(32.W))
-  val m = RegInit(0.U(32.W))
-  val size = RegInit(0.U(32.W))
+  val dt = RegInit(0.U(width.W))
+  val m = RegInit(0.U(width.W))
+  val size = RegInit(0.U(width.W))
   
-  val X = RegInit(0.U(32.W))
-  val Y = RegInit(0.U(32.W))
-  val Z = RegInit(0.U(32.W))
+  val X = RegInit(0.U(width.W))
+  val Y = RegInit(0.U(width.W))
+  val Z = RegInit(0.U(width.W))
 
-  val numberActiveBPE = RegInit(0.U(log2Ceil(BPE_num).W)) // To update only using the BPE holding data
+  // Staging buffer for the bulk body upload, holds a full CelestialBody record:
+  // X, Y, Z, dX, dY, dZ, mass, size (same order as the C struct)
+  val body_buffer = RegInit(VecInit(Seq.fill(8)(0.U(width.W))))
+  val body_buffer_idx = RegInit(0.U(3.W)) // Next value to write, wraps around after 8 values
 
-  io.locked := (lock_key =/= 0.U) // Unlock if key is set to 0
+  // Multi-word values: words already received, and next word of the value being received or sent
+  val in_words = RegInit(VecInit(Seq.fill(words)(0.U(32.W))))
+  val in_word = RegInit(0.U(word_width.W))
+  val out_word = RegInit(0.U(word_width.W))
 
-  defaultValues() // Set default values for the BPE switch, can be modified below depending on the command
+  val numberActiveBPE = RegInit(0.U(log2Ceil(body_num + 1).W)) // Number of bodies, to update only using the BPE holding data
+  // Test particles, set with command 30: their velocity is updated by the other bodies, but they are never broadcast
+  val massless = RegInit(VecInit(Seq.fill(body_num)(false.B)))
+  // Bodies merged into another one after a collision: they are neither broadcast nor updated anymore, until a body is
+  // loaded in their place
+  val absorbed = RegInit(VecInit(Seq.fill(body_num)(false.B)))
+
+  // Block timesteps: an iteration of dt is split in 2^block_levels sub-steps. All the positions move at every sub-step,
+  // by dt / 2^block_levels, while the velocity of a body of level L is only updated every 2^(block_levels - L)
+  // sub-steps, with dt / 2^L. The levels above block_levels are taken as block_levels
+  val level_width = BPE_interconnect.levelWidth
+  val levels = RegInit(VecInit(Seq.fill(body_num)(0.U(level_width.W)))) // Set with configuration register 9
+  val block_levels = RegInit(0.U(level_width.W)) // Set with configuration register 8, 0 = a single step per iteration
+  val block_step = RegInit(0.U(((1 << level_width) - 1).W)) // Sub-step of the iteration
+  val last_block_step = (1.U << block_levels) - 1.U
+  val body_level = VecInit(levels.map(level => Mux(level > block_levels, block_levels, level)))
+  // A body is due at the sub-steps that start one of its own steps, the absorbed bodies never are
+  def due_at(step: UInt): Vec[Bool] = VecInit(body_level.zip(absorbed).map { case (level, gone) =>
+    !gone && (step & ((1.U << (block_levels - level)) - 1.U)) === 0.U
+  })
+  val due = due_at(block_step)
+  // Newton-Raphson passes of the velocity update, fewer passes give shorter windows but less precise forces
+  val refinements = RegInit(BPU.defaultRefinements(tableSeed, format).U(BPU.refinementsWidth(format).W))
+
+  // Units of the BPUs, so that the host can send SI values: the positions, velocities and sizes are multiplied by
+  // 2^distance_scale when loaded, and divided by it when read back. The masses are multiplied by gravity and by
+  // 2^(3 * distance_scale), so that the BPUs get G * m in the same units, and are divided by both when read back
+  val distance_scale = RegInit(0.S(9.W)) // Set with configuration register 6, -128 to 127
+  val gravity = RegInit(format.one) // Set with command 31, 1 = the masses are already multiplied by G
+  val mass_scale = distance_scale * 3.S
+  val gravity_mult = Module(new FPMultiplier(format))
+  gravity_mult.io.a := 0.U
+  gravity_mult.io.b := gravity
+  // 1/G, computed again each time gravity is set, so that the stores only need the multiplier
+  val gravity_inv = Module(new FPReciprocal(format))
+  gravity_inv.io.in := 0.U
+  gravity_inv.io.start := false.B
 
-  val s_idle :: sRunning :: Nil = Enum(2)
+  io.locked := (lock_key =/= 0.U) // Unlock if key is set to 0
+
+  val s_idle :: sRunning :: sDMA :: Nil = Enum(3)
 
   val state = RegInit(s_idle)
+  io.dmaBusy := (state === sDMA)
+  // The packets wait in the queue during a DMA transfer, as the switch is used by the DMA engine,
+  // while the BPUs clear their records after a reset, and while 1/G is computed
+  io.dIn.ready := (state =/= sDMA) && !bp_switch.io.busy && !gravity_inv.io.busy
+
+  val dma_store = RegInit(false.B)
+  val dma_count = RegInit(0.U(32.W))
+  // The last word of a record is only in the staging buffer at the next cycle, so the commit is delayed by one
+  val dma_commit_pending = RegInit(false.B)
+  val dma_commit_target = RegInit(0.U(log2Ceil(body_num).W))
 
-  val internal_counter = RegInit(0.U(log2Ceil(BPE_num+1).W))
+  // Checkpoint, selected with configuration register 11 for the next DMA transfer only: instead of bodies in the units
+  // of the host, it moves the state of the simulation as it is in the accelerator, so that it can be restored exactly.
+  // Record 0 holds dt, the iteration, the maximum number of iterations, the number of active bodies and the settings,
+  // then each body takes two records: its values as they are in the BPU, then its flags
+  val dma_checkpoint = RegInit(false.B)
+  val dma_commit_record = RegInit(0.U(log2Ceil(2 * body_num + 1).W)) // Record committed, for the checkpoints
+  def checkpoint_body(record: UInt): UInt = ((record - 1.U) >> 1)(log2Ceil(body_num).max(1) - 1, 0)
+  def checkpoint_flags(record: UInt): Bool = record =/= 0.U && !record(0)
+
+  val internal_counter = RegInit(0.U(log2Ceil(body_num+1).W))
   // To give the BPEs enough cycles to update
   val substate_cntr = RegInit(0.U(5.W))
+  // Record updated in every BPU, goes through all the slots holding active bodies for each broadcast
+  val compute_slot = RegInit(0.U(log2Ceil(bodiesPerBPU).max(1).W))
+  val last_slot = if (bodiesPerBPU == 1) 0.U else Mux(numberActiveBPE === 0.U, 0.U, (numberActiveBPE - 1.U) >> log2Ceil(BPE_num))
+  // Symmetric pairs: a broadcast body only updates the bodies after it, the slots holding none of them are skipped
+  def first_slot(source: UInt): UInt = {
+    if (bodiesPerBPU == 1 || !symmetricPairs) 0.U else {
+      val slot = (source +& 1.U) >> log2Ceil(BPE_num)
+      Mux(slot > last_slot, last_slot, slot)
+    }
+  }
+  // Number of broadcast steps per iteration. With the ring, every hop of every slot holding active bodies is needed
+  val broadcast_count = if (ringInterconnect) (last_slot +& 1.U) << log2Ceil(BPE_num) else numberActiveBPE
+  // First body at or after from that is broadcast, broadcast_count if there is none. The massless bodies are skipped,
+  // except with symmetric pairs, where the broadcast body also gets the forces of the bodies after it, and with the
+  // ring, where the steps are hops and not bodies. The absorbed bodies are always skipped
+  def next_source(from: UInt): UInt = {
+    if (ringInterconnect) Mux(from > broadcast_count, broadcast_count, from) else {
+      val candidates = VecInit((0 until body_num).map { i =>
+        i.U >= from && i.U < numberActiveBPE && !absorbed(i) && (if (symmetricPairs) true.B else !massless(i))
+      })
+      Mux(candidates.asUInt.orR, PriorityEncoder(candidates), numberActiveBPE)
+    }
+  }
+  // And a slot only needs the bodies before its last one to be broadcast
+  def last_source(slot: UInt): UInt = {
+    if (bodiesPerBPU == 1 || !symmetricPairs) broadcast_count else {
+      Mux(slot === last_slot, broadcast_count, ((slot +& 1.U) << log2Ceil(BPE_num)) - 1.U)
+    }
+  }
 
-  val last_pckt_was_keep_alive = RegInit(false.B)
-  // Used to ensure the register isn't simply left on keep alive. Requires new keep alive packet to keep it alive
-  last_pckt_was_keep_alive := (command === 16.U) // Keep alive command
+  // Slots holding active bodies that are due, the velocity update skips the other ones
+  def slots_due(due: Vec[Bool]): Vec[Bool] = VecInit((0 until bodiesPerBPU).map { slot =>
+    (0 until BPE_num).map(i => slot * BPE_num + i).map(v => due(v) && v.U < numberActiveBPE).reduce(_ || _)
+  })
+  val slot_due = slots_due(due)
+  // First slot at or after from holding due bodies, last_slot if there is none
+  def next_due_slot(from: UInt, slot_due: Vec[Bool] = slot_due): UInt = {
+    if (bodiesPerBPU == 1) 0.U else {
+      val candidates = VecInit((0 until bodiesPerBPU).map(slot => slot.U >= from && slot_due(slot)))
+      Mux(candidates.asUInt.orR, PriorityEncoder(candidates), last_slot)
+    }
+  }
 
   val stop_when_collision = RegInit(false.B)
 
+  // Collision policy, set with configuration register 10: instead of stopping or going on, the two bodies that collided
+  // are merged once the velocity update is over, before the positions move. The heavier one takes the merged record,
+  // the other one is absorbed, and the event is pushed in the trajectory recorder's buffer. A collision is merged at a
+  // time, the BPUs are idle in the meantime
+  val merge_collisions = RegInit(false.B)
+  val merging = RegInit(false.B)
+  val mRead :: mCompute :: mStore :: mSettle :: Nil = Enum(4)
+  val merge_phase = RegInit(mRead)
+  val merge_cntr = RegInit(0.U(3.W))
+  val merge_bodies = RegInit(VecInit(Seq.fill(2)(0.U(log2Ceil(body_num).W)))) // Body that collided, and its partner
+  val merge_records = RegInit(VecInit(Seq.fill(2)(VecInit(Seq.fill(CollisionMerge.fields(symmetricPairs).length)(0.U(width.W))))))
+  val merge_logged = RegInit(false.B) // The buffer has room for the event
+  val merge_unit = Module(new CollisionMerge(symmetricPairs, unitStages, format))
+
   val currentIteration = RegInit(0.U(32.W))
   val max_iterations = RegInit(1000000.U) // Maximum number of iterations
   io.currentIteration := currentIteration
 
+  // Leapfrog (kick-drift-kick): the velocities get a half step before the first position update and after the last one,
+  // so that they stay half a step ahead of the positions in between and end at the same time as them
+  val leapfrog = RegInit(false.B) // Set with configuration register 7
+  val half_kick = RegInit(false.B) // The velocity update in progress is one of the half steps
+  val half_dt = format.scale(dt, -1.S)
+  val closing_kick = half_kick && currentIteration === max_iterations
+
+  // Pause, asked with command 13 and data(0) = 1: the simulation stops at the end of the current iteration, where the
+  // whole state is in the BPUs and in the registers of the checkpoint, and command 12 with data(0) = 1 resumes it
+  val pause_requested = RegInit(false.B)
+  val pausing = RegInit(false.B) // The iteration is over, stops once the frame it records is written
+
+  // Interrupt sources: bit 0 = max iteration reached or paused, bit 1 = stopped on collision or collision merged,
+  // bit 2 = every K iterations
+  val irq_enable = RegInit(0.U(3.W))
+  val irq_pending = RegInit(0.U(3.W))
+  val irq_tick_interval = RegInit(0.U(24.W)) // K, 0 = no periodic interrupt
+  val irq_tick_cntr = RegInit(0.U(24.W))
+  // Several places can raise or clear an interrupt in the same cycle, so they are combined at the end
+  val irq_done_set = WireDefault(false.B)
+  val irq_collision_set = WireDefault(false.B)
+  val irq_tick_set = WireDefault(false.B)
+  val irq_clear = WireDefault(0.U(3.W))
+  io.interrupt := (irq_pending & irq_enable).orR
+  io.irqPending := irq_pending
+
 
   // Only used when data is being outputted, not used when sending data in the BPEs
-  val target = RegInit(0.U(log2Ceil(BPE_num).W)) // Target BPE to send data to
+  val target = RegInit(0.U(log2Ceil(body_num).W)) // Target body to send data to
+
+  // Trajectory recorder: every N iterations, a frame made of the iteration number followed by
+  // X, Y, Z (and dX, dY, dZ if enabled) of each active BPU is pushed in a ring buffer, drained by the core with command 29
+  // Write first, as the word pushed in an empty buffer is read in advance in the same cycle
+  val record_mem = SyncReadMem(recordDepth, UInt(32.W), SyncReadMem.WriteFirst)
+  val record_ptr_width = log2Ceil(recordDepth) + 1 // One more bit to tell a full buffer from an empty one
+  val record_head = RegInit(0.U(record_ptr_width.W))
+  val record_tail = RegInit(0.U(record_ptr_width.W))
+  val record_dropped = RegInit(0.U(32.W))
+  val record_interval = RegInit(0.U(24.W)) // N, 0 = recorder disabled
+  val record_velocity = RegInit(false.B)
+  val record_cntr = RegInit(0.U(24.W))
+  val recording = RegInit(false.B) // A frame is being written
+  val record_body = RegInit(0.U(log2Ceil(body_num + 1).W))
+  val record_word = RegInit(0.U(3.W)) // 0 to 2 = position, 3 to 5 = velocity
+  val record_part = RegInit(0.U(word_width.W)) // Word of the value, for the values wider than 32 bits
+
+  // The memory has one cycle of latency, so the word at the next tail is read in advance
+  val record_tail_next = WireDefault(record_tail)
+  record_tail := record_tail_next
+  val record_word_out = record_mem.read(record_tail_next(record_ptr_width - 2, 0))
+
+  io.recordHead := record_head
+  io.recordTail := record_tail
+  io.recordDropped := record_dropped
+
+  // After all the registers it uses are defined, and before anything below overrides them
+  defaultValues() // Set default values for the BPE switch, can be modified below depending on the command
 
   // Increment last_valid_pckt_received_cnt, reset lock if it gets above a threshold
-  when (io.locked === true.B) {
+  // A started simulation doesn't need keep alive packets, as it ends by itself once max_iterations is reached
+  when (io.locked === true.B && state =/= sRunning) {
     last_valid_pckt_received_cnt := last_valid_pckt_received_cnt + 1.U
     when (last_valid_pckt_received_cnt === 1000000.U) {
       unlock() // The user process might have crashed, so we unlock
@@ -87,36 +311,360 @@ class CelestialTop(val BPE_num: Int) extends Module {
     is (sRunning) {
       running_state()
     }
+    is (sDMA) {
+      dma_state()
+    }
+  }
+
+  def dma_state(): Unit = {
+    // Value of the record and word of the value
+    val dma_value = io.dma.word >> log2Ceil(words)
+    val dma_part = if (words == 1) 0.U else io.dma.word(log2Ceil(words) - 1, 0)
+    when (dma_store) {
+      // The DMA engine asks for one word per cycle
+      val is_velocity = (dma_value >= 3.U) && (dma_value < 6.U)
+      bp_switch.io.target := io.dma.body
+      bp_switch.io.m_slct := Mux(is_velocity, 4.U, 6.U) // 4 = output velocity, 6 = output position
+      val record = VecInit(Seq(
+        bp_switch.io.X_out, bp_switch.io.Y_out, bp_switch.io.Z_out,
+        bp_switch.io.X_out, bp_switch.io.Y_out, bp_switch.io.Z_out).map(fromDistance) ++
+        Seq(fromMass(bp_switch.io.m_out), fromDistance(bp_switch.io.size_out)))
+      io.dma.storeData := valueWords(record(dma_value))(dma_part)
+      when (dma_checkpoint) {
+        val body = checkpoint_body(io.dma.body)
+        bp_switch.io.target := body
+        val values = VecInit(Seq(
+          bp_switch.io.X_out, bp_switch.io.Y_out, bp_switch.io.Z_out,
+          bp_switch.io.X_out, bp_switch.io.Y_out, bp_switch.io.Z_out,
+          bp_switch.io.m_out, bp_switch.io.size_out))
+        val value = Mux(io.dma.body === 0.U, checkpoint_header()(dma_value),
+          Mux(checkpoint_flags(io.dma.body), checkpoint_body_flags(body)(dma_value), values(dma_value)))
+        io.dma.storeData := valueWords(value)(dma_part)
+      }
+    } .otherwise {
+      // Same path as the bulk upload: fill the staging buffer, then commit it to the BPU
+      when (io.dma.loadValid) {
+        val value = WireDefault(valueWords(body_buffer(dma_value)))
+        value(dma_part) := io.dma.loadData
+        val bits = value.asUInt
+        body_buffer(dma_value) := bits(width - 1, 0)
+        when (io.dma.word === (8 * words - 1).U) {
+          dma_commit_pending := true.B
+          dma_commit_target := io.dma.body
+          dma_commit_record := io.dma.body
+        }
+      }
+      when (dma_commit_pending && dma_checkpoint) {
+        restore_record(dma_commit_record)
+        dma_commit_pending := false.B
+      } .elsewhen (dma_commit_pending) {
+        bp_switch.io.target := dma_commit_target
+        forwardBody()
+        bp_switch.io.m_slct := 8.U // 8 = load full body
+        absorbed(dma_commit_target) := false.B
+        dma_commit_pending := false.B
+      }
+    }
+
+    when (io.dma.done) {
+      state := s_idle
+      dma_checkpoint := false.B
+    }
+  }
+
+  // Header of the checkpoints, every value in the low bits of a value of the format. The settings are leapfrog in bit 0,
+  // the collision merge in bit 1, the stop on collision in bit 2, the block levels from bit 3 and the passes from bit 6
+  def checkpoint_header(): Vec[UInt] = VecInit(Seq(dt, currentIteration, max_iterations, numberActiveBPE,
+    Cat(refinements, block_levels, stop_when_collision, merge_collisions, leapfrog), distance_scale.asUInt, gravity,
+    0.U).map(_.pad(width)))
+
+  // Flags of a body in the checkpoints: whether it holds its BPU's collision, massless in bit 1, absorbed in bit 2 and
+  // the level from bit 3, then the body it collided with
+  def checkpoint_body_flags(body: UInt): Vec[UInt] = VecInit(Seq(
+    Cat(levels(body), absorbed(body), massless(body), bp_switch.io.target_collided),
+    bp_switch.io.target_partner).map(_.pad(width)) ++ Seq.fill(6)(0.U(width.W)))
+
+  // Restore a record of a checkpoint from the staging buffer. The values of a body are loaded as they were, which clears
+  // its collision, so its flags come after them
+  def restore_record(record: UInt): Unit = {
+    val body = checkpoint_body(record)
+    when (record === 0.U) {
+      dt := body_buffer(0)
+      currentIteration := body_buffer(1)
+      max_iterations := body_buffer(2)
+      numberActiveBPE := body_buffer(3)
+      val settings = body_buffer(4)
+      leapfrog := settings(0)
+      merge_collisions := settings(1)
+      stop_when_collision := settings(2)
+      block_levels := settings(level_width + 2, 3)
+      refinements := settings(BPU.refinementsWidth(format) + 5, 6)
+      distance_scale := body_buffer(5)(8, 0).asSInt
+      setGravity(body_buffer(6))
+      // The checkpoints are taken between two iterations
+      block_step := 0.U
+      half_kick := false.B
+    } .elsewhen (checkpoint_flags(record)) {
+      val flags = body_buffer(0)
+      massless(body) := flags(1)
+      absorbed(body) := flags(2)
+      levels(body) := flags(level_width + 2, 3)
+      when (flags(0)) {
+        bp_switch.io.target := body
+        bp_switch.io.X_in := body_buffer(1)
+        bp_switch.io.m_slct := 11.U // 11 = set collision
+      }
+    } .otherwise {
+      bp_switch.io.target := body
+      bp_switch.io.X_in := body_buffer(0)
+      bp_switch.io.Y_in := body_buffer(1)
+      bp_switch.io.Z_in := body_buffer(2)
+      bp_switch.io.VX_in := body_buffer(3)
+      bp_switch.io.VY_in := body_buffer(4)
+      bp_switch.io.VZ_in := body_buffer(5)
+      bp_switch.io.m_in := body_buffer(6)
+      bp_switch.io.size_in := body_buffer(7)
+      bp_switch.io.m_slct := 8.U // 8 = load full body
+    }
   }
 
   def running_state(): Unit = {
     // Iterate over each of the active BPEs, tell them to broadcast their data
     // Once it is done, update position and return to BPE nbr 0
-    when (request_valid) {
-      val reach_end = (internal_counter === numberActiveBPE)
-      when (reach_end) {
-        update_position()
-      } .otherwise {
-        update_velocity()
+    // The simulation runs by itself, the packets are only needed to control it
+    val reach_end = (internal_counter === broadcast_count)
+    when (recording) {
+      record_step()
+    } .elsewhen (pausing) {
+      state := s_idle
+      pausing := false.B
+      pause_requested := false.B
+      irq_done_set := true.B
+    } .elsewhen (merging) {
+      merge_step()
+    } .elsewhen (reach_end) {
+      // The BPUs must finish the velocity updates before the positions move
+      when (!bp_switch.io.pipeline_busy) {
+        when (merge_collisions && bp_switch.io.collided) {
+          merging := true.B
+          merge_bodies(0) := bp_switch.io.collision_id
+          merge_bodies(1) := bp_switch.io.collision_partner
+        } .otherwise {
+          if (symmetricPairs) {
+            update_position()
+          } else {
+            when (closing_kick) {
+              finish() // The closing half kick is done
+            } .otherwise {
+              update_position()
+            }
+          }
+        }
       }
+    } .otherwise {
+      update_velocity()
+    }
 
-      // Handle collision detection
-      when (bp_switch.io.collided === true.B && stop_when_collision === true.B) {
-        // Stop the simulation if a collision is detected
-        state := s_idle
-      }
+    // Handle collision detection
+    when (bp_switch.io.collided === true.B && stop_when_collision === true.B && !merge_collisions) {
+      // Stop the simulation if a collision is detected
+      state := s_idle
+      half_kick := false.B
+      irq_collision_set := true.B
+    }
 
+    when (request_valid) {
       switch (command) {
         // Only need to handle stop simulation, keep alive, and unlock in the running state
         is (1.U) { // Unlock
           unlock()
         }
-        is (13.U) { // Stop simulation
-          state := s_idle
+        is (13.U) { // Stop simulation, data(0) = 1 to pause it at the end of the iteration instead
+          when (data(0)) {
+            pause_requested := true.B
+          } .otherwise {
+            state := s_idle
+            half_kick := false.B
+          }
         }
         is (16.U) { // Keep alive
           handle_keep_alive()
         }
+        is (28.U) { // Set configuration register, only clearing interrupts is allowed while running
+          when (data(31, 24) === 2.U) {
+            irq_clear := data(2, 0)
+          }
+        }
+        is (29.U) { // Pop a word from the trajectory recorder, the core can drain it while the simulation runs
+          record_pop()
+        }
+      }
+    }
+  }
+
+  // Start a frame, unless the buffer doesn't have enough space for it
+  def record_frame(): Unit = {
+    val words_per_body = Mux(record_velocity, 6.U, 3.U)
+    val frame_words = 1.U + numberActiveBPE * words_per_body * words.U // Iteration number + the bodies
+    val free_words = recordDepth.U - (record_head - record_tail)
+    when (free_words >= frame_words) {
+      record_push(currentIteration + 1.U)
+      recording := (numberActiveBPE =/= 0.U)
+      record_body := 0.U
+      record_word := 0.U
+      record_part := 0.U
+    } .otherwise {
+      record_dropped := record_dropped + 1.U
+    }
+  }
+
+  // Push one word of the frame per cycle, the BPUs are idle in the meantime
+  def record_step(): Unit = {
+    val words_per_body = Mux(record_velocity, 6.U, 3.U)
+    val is_velocity = record_word >= 3.U
+    bp_switch.io.target := record_body
+    bp_switch.io.m_slct := Mux(is_velocity, 4.U, 6.U) // 4 = output velocity, 6 = output position
+    val axis = Mux(is_velocity, record_word - 3.U, record_word)
+    val value = VecInit(Seq(bp_switch.io.X_out, bp_switch.io.Y_out, bp_switch.io.Z_out))(axis(1, 0))
+    record_push(valueWords(fromDistance(value))(record_part))
+
+    // Values wider than 32 bits are pushed one word per cycle, low word first
+    record_part := nextWord(record_part)
+    when (record_part === (words - 1).U) {
+      when (record_word === words_per_body - 1.U) {
+        record_word := 0.U
+        when (record_body === numberActiveBPE - 1.U) {
+          recording := false.B
+        } .otherwise {
+          record_body := record_body + 1.U
+        }
+      } .otherwise {
+        record_word := record_word + 1.U
+      }
+    }
+  }
+
+  def record_push(value: UInt): Unit = {
+    record_mem.write(record_head(record_ptr_width - 2, 0), value)
+    record_head := record_head + 1.U
+  }
+
+  def record_pop(): Unit = {
+    val bit_flip_mask = data // Used to encrypt the data
+    when (record_head =/= record_tail) {
+      record_tail_next := record_tail + 1.U
+      dOut := record_word_out ^ bit_flip_mask
+    } .otherwise {
+      dOut := NaN
+    }
+  }
+
+  // Merge of the bodies of a collision, from the records as they are in the BPUs
+  def merge_step(): Unit = {
+    // Position, mass and size, then velocity, then the reactions still to apply with symmetric pairs
+    val parts = if (symmetricPairs) 3 else 2
+    val side = merge_cntr >= parts.U
+    val part = Mux(side, merge_cntr - parts.U, merge_cntr)
+    // The masses are positive, so their bits are in the same order as them. The body that collided wins a tie
+    val first_survives = !(merge_records(1)(6) > merge_records(0)(6))
+    val survivor = Mux(first_survives, merge_bodies(0), merge_bodies(1))
+    val absorbed_body = Mux(first_survives, merge_bodies(1), merge_bodies(0))
+    switch (merge_phase) {
+      is (mRead) { // One part of a record per cycle
+        val record = merge_records(side)
+        bp_switch.io.target := merge_bodies(side)
+        switch (part) {
+          is (0.U) {
+            bp_switch.io.m_slct := 6.U // 6 = output position
+            record(0) := bp_switch.io.X_out
+            record(1) := bp_switch.io.Y_out
+            record(2) := bp_switch.io.Z_out
+            record(6) := bp_switch.io.m_out
+            record(7) := bp_switch.io.size_out
+          }
+          is (1.U) {
+            bp_switch.io.m_slct := 4.U // 4 = output velocity
+            record(3) := bp_switch.io.X_out
+            record(4) := bp_switch.io.Y_out
+            record(5) := bp_switch.io.Z_out
+          }
+          is (2.U) {
+            if (symmetricPairs) {
+              bp_switch.io.m_slct := 10.U // 10 = output reactions
+              record(8) := bp_switch.io.X_out
+              record(9) := bp_switch.io.Y_out
+              record(10) := bp_switch.io.Z_out
+            }
+          }
+        }
+        merge_cntr := merge_cntr + 1.U
+        when (merge_cntr === (2 * parts - 1).U) {
+          merge_cntr := 0.U
+          merge_phase := mCompute
+        }
+      }
+      is (mCompute) {
+        when (merge_cntr === 0.U) {
+          // A collision with a body absorbed since it was detected is dropped
+          when (absorbed(merge_bodies(0)) || absorbed(merge_bodies(1))) {
+            bp_switch.io.target := merge_bodies(0)
+            bp_switch.io.m_slct := 9.U // 9 = clear collision
+            merge_phase := mSettle
+          } .otherwise {
+            merge_unit.io.start := true.B
+            merge_cntr := 1.U
+          }
+        } .elsewhen (!merge_unit.io.busy) {
+          merge_cntr := 0.U
+          merge_phase := mStore
+        }
+      }
+      is (mStore) {
+        // Loading the records clears their collisions
+        merge_cntr := merge_cntr + 1.U
+        when (merge_cntr === 0.U) {
+          bp_switch.io.target := survivor
+          bp_switch.io.X_in := merge_unit.io.merged(0)
+          bp_switch.io.Y_in := merge_unit.io.merged(1)
+          bp_switch.io.Z_in := merge_unit.io.merged(2)
+          bp_switch.io.VX_in := merge_unit.io.merged(3)
+          bp_switch.io.VY_in := merge_unit.io.merged(4)
+          bp_switch.io.VZ_in := merge_unit.io.merged(5)
+          bp_switch.io.m_in := merge_unit.io.merged(6)
+          bp_switch.io.size_in := merge_unit.io.merged(7)
+          bp_switch.io.m_slct := 8.U // 8 = load full body
+          massless(survivor) := massless(merge_bodies(0)) && massless(merge_bodies(1))
+        } .elsewhen (merge_cntr === 1.U) {
+          bp_switch.io.target := absorbed_body
+          bp_switch.io.m_slct := 8.U // 8 = load full body, empty as the inputs are 0
+          absorbed(absorbed_body) := true.B
+          irq_collision_set := true.B
+          // Event of 3 words: the iteration with bit 31 set, which tells it from a frame, the survivor and the absorbed body
+          val free_words = recordDepth.U - (record_head - record_tail)
+          merge_logged := free_words >= 3.U
+          when (free_words >= 3.U) {
+            record_push(Cat(1.U(1.W), currentIteration(30, 0)))
+          } .otherwise {
+            record_dropped := record_dropped + 1.U
+          }
+        } .otherwise {
+          when (merge_logged) {
+            record_push(Mux(merge_cntr === 2.U, survivor, absorbed_body))
+          }
+          when (merge_cntr === 3.U) {
+            merge_cntr := 0.U
+            merge_phase := mSettle
+          }
+        }
+      }
+      is (mSettle) {
+        // The clustered switch only shows the cleared collisions 3 cycles later
+        merge_cntr := merge_cntr + 1.U
+        when (merge_cntr === 2.U) {
+          merge_cntr := 0.U
+          merge_phase := mRead
+          merging := false.B
+        }
       }
     }
   }
@@ -125,31 +673,114 @@ class CelestialTop(val BPE_num: Int) extends Module {
     // printf(p"Updating position\n")
     // Update the position of the BPEs
     bp_switch.io.m_slct := 1.U // 1 = update position
+    bp_switch.io.slot := compute_slot
+    // With symmetric pairs, the reactions of the closing half kick are only subtracted from the velocities by a
+    // position update: it runs once more with dt = 0, which leaves the positions as they are
+    bp_switch.io.dt := Mux(closing_kick, 0.U, format.scale(dt, -block_levels.zext))
+    when (!closing_kick) {
+      half_kick := false.B
+    }
+    bp_switch.io.sync := (substate_cntr === 0.U)
     substate_cntr := substate_cntr + 1.U
-    when (substate_cntr === 3.U) { // 4 cycles of wait, as takes one cycle to update
+    val last_substate = (BPU.positionWindow(bpuLanes, symmetricPairs, unitStages) - 1).U
+    when (substate_cntr === last_substate && compute_slot =/= last_slot) { // Next slot holding active bodies
+      substate_cntr := 0.U
+      compute_slot := compute_slot + 1.U
+    } .elsewhen (substate_cntr === last_substate) { // One fused multiply-add per axis, spread over the lanes
       substate_cntr := 0.U
-      internal_counter := 0.U
+      // The velocity update of the next sub-step starts from its first slot holding due bodies, and is skipped when
+      // none is due
+      val next_step = Mux(block_step === last_block_step, 0.U, block_step + 1.U)
+      block_step := next_step
+      val next_slots = slots_due(due_at(next_step))
+      compute_slot := next_due_slot(0.U, next_slots)
+      internal_counter := Mux(next_slots.asUInt.orR, next_source(0.U), broadcast_count) // The first body that is broadcast
       
       // + 2 as it takes 1 cycle to update a register, and must finish at one below the max iteration number as it is non inclusive
-      when (currentIteration + 1.U === max_iterations) {
+      when (closing_kick) {
+        finish()
+      } .elsewhen (block_step =/= last_block_step) {
+        // Sub-step, the iteration goes on
+      } .elsewhen (currentIteration + 1.U === max_iterations && leapfrog) {
+        // The velocities still need the closing half kick, the simulation stops once it is done
+        currentIteration := max_iterations
+        half_kick := true.B
+      } .elsewhen (currentIteration + 1.U === max_iterations) {
         // Stop the simulation if the maximum number of iterations is reached
-        state := s_idle
-        currentIteration := 0.U
+        finish()
       }
       .otherwise {
         currentIteration := currentIteration + 1.U
+        when (pause_requested) {
+          pausing := true.B
+        }
+
+        // Trajectory recorder, every N iterations. Not for the last iteration, as the simulation stops at the same time
+        when (record_interval =/= 0.U) {
+          when (record_cntr + 1.U === record_interval) {
+            record_cntr := 0.U
+            record_frame()
+          } .otherwise {
+            record_cntr := record_cntr + 1.U
+          }
+        }
+      }
+
+      // Periodic interrupt, every K iterations
+      when (irq_tick_interval =/= 0.U && block_step === last_block_step) {
+        when (irq_tick_cntr + 1.U === irq_tick_interval) {
+          irq_tick_cntr := 0.U
+          irq_tick_set := true.B
+        } .otherwise {
+          irq_tick_cntr := irq_tick_cntr + 1.U
+        }
       }
     }
   }
 
+  def finish(): Unit = {
+    state := s_idle
+    currentIteration := 0.U
+    block_step := 0.U
+    half_kick := false.B
+    irq_done_set := true.B
+  }
+
   // Update the velocity of the BPEs
   def update_velocity(): Unit = {
     bp_switch.io.m_slct := 0.U 
     bp_switch.io.target := internal_counter
-    substate_cntr := substate_cntr + 1.U
-    when (substate_cntr === 22.U) {
-      substate_cntr := 0.U
-      internal_counter := internal_counter + 1.U
+    bp_switch.io.slot := compute_slot
+    if (pipelinedBPU) {
+      // A new body is broadcast every cycle, the BPUs' pipelines update the velocities in the background.
+      // All the bodies are broadcast to one slot before moving to the next one, the sum is done in the same order
+      // The slots holding no due bodies are skipped
+      val next = next_source(internal_counter + 1.U)
+      val next_slot = next_due_slot(compute_slot +& 1.U)
+      when (next >= last_source(compute_slot) && compute_slot =/= last_slot && slot_due(next_slot)) {
+        internal_counter := next_source(0.U)
+        compute_slot := next_slot
+      } .otherwise {
+        internal_counter := next
+        when (next === broadcast_count) {
+          compute_slot := 0.U
+        }
+      }
+    } else {
+      bp_switch.io.sync := (substate_cntr === 0.U)
+      substate_cntr := substate_cntr + 1.U
+      // The BPUs accept a new body every window, while they finish the previous ones
+      when (substate_cntr === BPU.lastWindowCycle(bpuLanes, symmetricPairs, refinements, tableSeed, format)) {
+        substate_cntr := 0.U
+        // The broadcast body is sent to every slot holding active bodies that are due before moving to the next one
+        val next_slot = next_due_slot(compute_slot +& 1.U)
+        when (compute_slot === last_slot || !slot_due(next_slot)) {
+          compute_slot := next_due_slot(first_slot(internal_counter + 1.U))
+          internal_counter := next_source(internal_counter + 1.U)
+        } .otherwise {
+          compute_slot := next_slot
+        }
+      }
     }
   }
   
@@ -166,31 +797,32 @@ class CelestialTop(val BPE_num: Int) extends Module {
           unlock()
         }
         is (3.U) { // Set X
-          X := data
+          inputValue(X := _)
         }
         is (4.U) { // Set Y
-          Y := data
+          inputValue(Y := _)
         }
         is (5.U) { // Set Z
-          Z := data
+          inputValue(Z := _)
         }
         is (6.U) { // Set mass
-          m := data
+          inputValue(m := _)
         }
         is (7.U) { // Set size
-          size := data
+          inputValue(size := _)
         }
         is (8.U) { // Set dt
-          dt := data
+          inputValue(dt := _)
         }
         is (9.U) { // Set target, forward data as position
-          val truncated_data = data(log2Ceil(BPE_num), 0)
+          val truncated_data = data(log2Ceil(body_num), 0)
           bp_switch.io.target := truncated_data
           forwardData()
           bp_switch.io.m_slct := 2.U // 2 = set position
+          absorbed(data(log2Ceil(body_num).max(1) - 1, 0)) := false.B
         }
         is (10.U) { // Set target, forward data as velocity
-          val truncated_data = data(log2Ceil(BPE_num), 0)
+          val truncated_data = data(log2Ceil(body_num), 0)
           bp_switch.io.target := truncated_data
           forwardData()
           bp_switch.io.m_slct := 3.U // 3 = set velocity
@@ -198,10 +830,34 @@ class CelestialTop(val BPE_num: Int) extends Module {
         is (11.U) { // Set tstop_when_collision
           stop_when_collision := data(0) // 1 = stop when collision
         }
-        is (12.U) { // Start simulation
-        // Start at the number of active BPEs, so that it starts with a position update instead of a velocity update
-          internal_counter := numberActiveBPE
-          currentIteration := 0.U
+        is (12.U) { // Start simulation, data(0) = 1 to resume a paused or restored one
+          when (data(0)) {
+            // The next iteration starts with its velocity update, from the first slot holding due bodies. The iteration,
+            // the counters and the recorder's buffer are kept
+            internal_counter := Mux(slot_due.asUInt.orR, next_source(0.U), broadcast_count)
+            compute_slot := next_due_slot(0.U)
+            substate_cntr := 0.U
+            half_kick := false.B
+          } .otherwise {
+            // Start at the number of broadcast steps, so that it starts with a position update instead of a velocity
+            // update. In leapfrog, it starts with the opening half kick instead, from the first body that is broadcast
+            internal_counter := Mux(leapfrog, next_source(0.U), broadcast_count)
+            half_kick := leapfrog
+            block_step := 0.U
+            compute_slot := 0.U
+            currentIteration := 0.U
+            irq_tick_cntr := 0.U
+            record_cntr := 0.U
+            recording := false.B
+            record_head := 0.U
+            record_tail := 0.U
+            record_dropped := 0.U
+          }
+          merging := false.B
+          merge_phase := mRead
+          merge_cntr := 0.U
+          pause_requested := false.B
+          pausing := false.B
           state := sRunning
         }
         is (13.U) { // Stop simulation
@@ -210,79 +866,173 @@ class CelestialTop(val BPE_num: Int) extends Module {
         is (14.U) { // Set max iteration number
           max_iterations := data        
         }
-        is (15.U) { // Set number of active BPEs
-          numberActiveBPE := data(log2Ceil(BPE_num), 0)
+        is (15.U) { // Set number of active bodies, can be up to BPE_num * bodiesPerBPU
+          numberActiveBPE := data(log2Ceil(body_num), 0)
         }
         is (16.U) { // Keep alive
           handle_keep_alive()
         }
         is (17.U) { // Set target
-          target := data(log2Ceil(BPE_num), 0)        
+          target := data(log2Ceil(body_num), 0)        
+          out_word := 0.U // The next output command sends the low word of the value
         }
         is (18.U) { // Output the target BPE's X position
           bp_switch.io.target := target
           bp_switch.io.m_slct := 6.U // 6 = output position
-          val X_out = bp_switch.io.X_out
+          val X_out = outputValue(fromDistance(bp_switch.io.X_out))
           val bit_flip_mask = data // Used to encrypt the data
           val X_out_encrypted = X_out ^ bit_flip_mask
-          io.dOut := X_out_encrypted
+          dOut := X_out_encrypted
         }
         is (19.U) { // Output the target BPE's Y position
           bp_switch.io.target := target
           bp_switch.io.m_slct := 6.U // 6 = output position
-          val Y_out = bp_switch.io.Y_out
+          val Y_out = outputValue(fromDistance(bp_switch.io.Y_out))
           val bit_flip_mask = data // Used to encrypt the data
           val Y_out_encrypted = Y_out ^ bit_flip_mask
-          io.dOut := Y_out_encrypted
+          dOut := Y_out_encrypted
         }
         is (20.U) { // Output the target BPE's Z position
           bp_switch.io.target := target
           bp_switch.io.m_slct := 6.U // 6 = output velocity
-          val Z_out = bp_switch.io.Z_out
+          val Z_out = outputValue(fromDistance(bp_switch.io.Z_out))
           val bit_flip_mask = data // Used to encrypt the data
           val Z_out_encrypted = Z_out ^ bit_flip_mask
-          io.dOut := Z_out_encrypted
+          dOut := Z_out_encrypted
         }
         is (21.U) { // Output the target BPE's dX
           bp_switch.io.target := target
           bp_switch.io.m_slct := 4.U // 4 = output velocity
-          val X_out = bp_switch.io.X_out
+          val X_out = outputValue(fromDistance(bp_switch.io.X_out))
           val bit_flip_mask = data // Used to encrypt the data
           val X_out_encrypted = X_out ^ bit_flip_mask
-          io.dOut := X_out_encrypted
+          dOut := X_out_encrypted
         }
         is (22.U) { // Output the target BPE's dY
           bp_switch.io.target := target
           bp_switch.io.m_slct := 4.U // 4 = output velocity
-          val Y_out = bp_switch.io.Y_out
+          val Y_out = outputValue(fromDistance(bp_switch.io.Y_out))
           val bit_flip_mask = data // Used to encrypt the data
           val Y_out_encrypted = Y_out ^ bit_flip_mask
-          io.dOut := Y_out_encrypted
+          dOut := Y_out_encrypted
         }
         is (23.U) { // Output the target BPE's dZ
           bp_switch.io.target := target
           bp_switch.io.m_slct := 4.U // 4 = output velocity
-          val Z_out = bp_switch.io.Z_out
+          val Z_out = outputValue(fromDistance(bp_switch.io.Z_out))
           val bit_flip_mask = data // Used to encrypt the data
           val Z_out_encrypted = Z_out ^ bit_flip_mask
-          io.dOut := Z_out_encrypted
+          dOut := Z_out_encrypted
         }
         is (24.U) { // Output the ID of the BPE that collided
           val collision_id = bp_switch.io.collision_id
           val bit_flip_mask = data // Used to encrypt the data
-          val extended_collision_id = Cat(0.U((32-log2Ceil(BPE_num)).W), collision_id) // Extend to 64 bits
-          io.dOut := extended_collision_id ^ bit_flip_mask
+          val extended_collision_id = Cat(0.U((32-log2Ceil(body_num)).W), collision_id) // Extend to 32 bits
+          dOut := extended_collision_id ^ bit_flip_mask
+        }
+        is (25.U) { // Load one word of a body record in the staging buffer
+          inputValue { value =>
+            body_buffer(body_buffer_idx) := value
+            body_buffer_idx := body_buffer_idx + 1.U
+          }
+        }
+        is (26.U) { // Set target, commit the staging buffer as position, velocity, mass and size
+          val truncated_data = data(log2Ceil(body_num), 0)
+          bp_switch.io.target := truncated_data
+          forwardBody()
+          bp_switch.io.m_slct := 8.U // 8 = load full body
+          absorbed(data(log2Ceil(body_num).max(1) - 1, 0)) := false.B
+          body_buffer_idx := 0.U // Next record starts from X again
+        }
+        is (27.U) { // DMA transfer, address in {Y, X}, data(31) = direction, data(30, 0) = number of bodies
+          val requested = data(30, 0)
+          val count = Mux(requested > body_num.U, body_num.U, requested) // Can't transfer more bodies than the BPUs can hold
+          // A checkpoint is the header and two records per body, all the active bodies when it is stored
+          val checkpoint_count = Cat(Mux(data(31), numberActiveBPE, count), 1.U(1.W))
+          val records = Mux(dma_checkpoint, checkpoint_count, count)
+          io.dma.start := true.B
+          io.dma.store := data(31)
+          io.dma.count := records
+          dma_store := data(31)
+          dma_count := records
+          dma_commit_pending := false.B
+          state := sDMA
+        }
+        is (28.U) { // Set configuration register, data(31, 24) = register ID, data(23, 0) = value
+          set_config(data(31, 24), data(23, 0))
+        }
+        is (29.U) { // Pop a word from the trajectory recorder
+          record_pop()
+        }
+        is (30.U) { // Set whether a body is massless, data(31) = massless, data(30, 0) = target
+          massless(data(log2Ceil(body_num).max(1) - 1, 0)) := data(31)
+        }
+        is (31.U) { // Set the factor of the masses, usually G
+          inputValue(setGravity)
         }
         // No other commands are implemented
       }
     }
   }
 
+  // Configuration registers, set with command 28
+  // 0 = interrupt enable mask, 1 = K for the periodic interrupt (0 = disabled), 2 = clear pending interrupts (mask)
+  // 3 = N for the trajectory recorder (0 = disabled), 4 = also record the velocities
+  // 5 = Newton-Raphson passes of the velocity update, up to BPU.maxRefinementsFor(format)
+  // 6 = distance scale, signed exponent in value(7, 0): the BPUs get the distances multiplied by 2^value
+  // 7 = leapfrog integrator (kick-drift-kick) instead of Euler
+  // 8 = number of block timestep levels, an iteration is split in 2^value sub-steps (ignored with symmetric pairs)
+  // 9 = timestep level of a body, value(23, 21) = level, value(20, 0) = body
+  // 10 = collision policy, 1 = merge the bodies that collided and go on (command 11 is then ignored)
+  // 11 = 1 for the next DMA transfer to store or restore a checkpoint, the number of bodies is only used by a restore
+  def set_config(id: UInt, value: UInt): Unit = {
+    switch (id) {
+      is (0.U) {
+        irq_enable := value(2, 0)
+      }
+      is (1.U) {
+        irq_tick_interval := value
+      }
+      is (2.U) {
+        irq_clear := value(2, 0)
+      }
+      is (3.U) {
+        record_interval := value
+      }
+      is (4.U) {
+        record_velocity := value(0)
+      }
+      is (5.U) {
+        val max = BPU.maxRefinementsFor(format)
+        refinements := Mux(value > max.U, max.U, value)
+      }
+      is (6.U) {
+        distance_scale := value(7, 0).asSInt
+      }
+      is (7.U) {
+        leapfrog := value(0)
+      }
+      is (8.U) {
+        // With symmetric pairs, the reaction of a pair would need both bodies to be due
+        if (!symmetricPairs) {
+          block_levels := value(level_width - 1, 0)
+        }
+      }
+      is (9.U) {
+        levels(value(log2Ceil(body_num).max(1) - 1, 0)) := value(23, 21)
+      }
+      is (10.U) {
+        merge_collisions := value(0)
+      }
+      is (11.U) {
+        dma_checkpoint := value(0)
+      }
+    }
+  }
+
   def handle_keep_alive(): Unit = {
-    when (last_pckt_was_keep_alive === false.B) {
-      last_valid_pckt_received_cnt := 0.U
-      last_pckt_was_keep_alive := true.B
-    } 
+    // Each keep alive packet is only executed once, so it can't be left in the register to keep the lock forever
+    last_valid_pckt_received_cnt := 0.U
   }
 
   def attemptLock(): Unit = {
@@ -306,20 +1056,98 @@ class CelestialTop(val BPE_num: Int) extends Module {
     bp_switch.io.Z_in := 0.U
     bp_switch.io.size_in := 0.U
     bp_switch.io.m_in := 0.U
-    bp_switch.io.dt := dt
+    bp_switch.io.VX_in := 0.U
+    bp_switch.io.VY_in := 0.U
+    bp_switch.io.VZ_in := 0.U
+    bp_switch.io.dt := Mux(half_kick, half_dt, dt)
     bp_switch.io.m_slct := 7.U // 7 = idle
     bp_switch.io.target := 0.U
-    // Output NaN
-    val NaN = 0x7FC00000.U
-    io.dOut := NaN
+    bp_switch.io.slot := 0.U
+    bp_switch.io.sync := false.B
+    bp_switch.io.active := numberActiveBPE
+    bp_switch.io.refinements := refinements
+    bp_switch.io.due := due
+    bp_switch.io.level := body_level
+    bp_switch.io.absorbed := absorbed
+
+    merge_unit.io.start := false.B
+    merge_unit.io.a := merge_records(0)
+    merge_unit.io.b := merge_records(1)
+
+    io.dma.start := false.B
+    io.dma.store := dma_store
+    io.dma.addr := Cat(Y(31, 0), X(31, 0))
+    io.dma.count := dma_count
+    io.dma.storeData := 0.U
+  }
+
+  // Words of a value, low word first
+  def valueWords(value: UInt): Vec[UInt] = value.pad(32 * words).asTypeOf(Vec(words, UInt(32.W)))
+
+  def nextWord(word: UInt): UInt = Mux(word === (words - 1).U, 0.U, word + 1.U)
+
+  // Each packet setting a value carries one of its words, the value is written once its last word is received
+  def inputValue(write: UInt => Unit): Unit = {
+    if (words == 1) {
+      write(data)
+    } else {
+      when (in_word === (words - 1).U) {
+        val value = Cat(data +: in_words.take(words - 1).reverse)
+        write(value(width - 1, 0))
+      } .otherwise {
+        in_words(in_word) := data
+      }
+      in_word := nextWord(in_word)
+    }
+  }
+
+  // Each output command sends the next word of the value
+  def outputValue(value: UInt): UInt = {
+    if (words == 1) {
+      value
+    } else {
+      out_word := nextWord(out_word)
+      valueWords(value)(out_word)
+    }
+  }
+
+  // Values in the units of the BPUs, and back. The exponents are adjusted, only G and 1/G need a multiplication
+  def toDistance(value: UInt): UInt = format.scale(value, distance_scale)
+  def fromDistance(value: UInt): UInt = format.scale(value, -distance_scale)
+  def toMass(value: UInt): UInt = {
+    gravity_mult.io.a := value
+    format.scale(gravity_mult.io.out, mass_scale)
+  }
+  def fromMass(value: UInt): UInt = {
+    gravity_mult.io.a := value
+    gravity_mult.io.b := gravity_inv.io.out
+    format.scale(gravity_mult.io.out, -mass_scale)
+  }
+  def setGravity(value: UInt): Unit = {
+    gravity := value
+    gravity_inv.io.in := value
+    gravity_inv.io.start := true.B
   }
 
   def forwardData(): Unit = {
-    bp_switch.io.X_in := X
-    bp_switch.io.Y_in := Y
-    bp_switch.io.Z_in := Z
-    bp_switch.io.size_in := size
-    bp_switch.io.m_in := m
+    bp_switch.io.X_in := toDistance(X)
+    bp_switch.io.Y_in := toDistance(Y)
+    bp_switch.io.Z_in := toDistance(Z)
+    bp_switch.io.size_in := toDistance(size)
+    bp_switch.io.m_in := toMass(m)
+    bp_switch.io.dt := dt
+  }
+
+  // Forward the full record held in the staging buffer
+  def forwardBody(): Unit = {
+    bp_switch.io.X_in := toDistance(body_buffer(0))
+    bp_switch.io.Y_in := toDistance(body_buffer(1))
+    bp_switch.io.Z_in := toDistance(body_buffer(2))
+    bp_switch.io.VX_in := toDistance(body_buffer(3))
+    bp_switch.io.VY_in := toDistance(body_buffer(4))
+    bp_switch.io.VZ_in := toDistance(body_buffer(5))
+    bp_switch.io.m_in := toMass(body_buffer(6))
+    bp_switch.io.size_in := toDistance(body_buffer(7))
     bp_switch.io.dt := dt
   }
 
@@ -332,19 +1160,72 @@ class CelestialTop(val BPE_num: Int) extends Module {
     X := 0.U
     Y := 0.U
     Z := 0.U
+    for (i <- 0 until 8) {
+      body_buffer(i) := 0.U
+    }
+    body_buffer_idx := 0.U
+    for (i <- 0 until in_words.length) {
+      in_words(i) := 0.U
+    }
+    in_word := 0.U
+    out_word := 0.U
+    dma_store := false.B
+    dma_count := 0.U
+    dma_commit_pending := false.B
+    dma_checkpoint := false.B
     numberActiveBPE := 0.U
+    for (i <- 0 until body_num) {
+      massless(i) := false.B
+      absorbed(i) := false.B
+    }
+    irq_enable := 0.U
+    irq_clear := "b111".U
+    irq_tick_interval := 0.U
+    irq_tick_cntr := 0.U
+    record_interval := 0.U
+    record_velocity := false.B
+    refinements := BPU.defaultRefinements(tableSeed, format).U
+    distance_scale := 0.S
+    setGravity(format.one)
+    leapfrog := false.B
+    half_kick := false.B
+    block_levels := 0.U
+    block_step := 0.U
+    for (i <- 0 until body_num) {
+      levels(i) := 0.U
+    }
+    merge_collisions := false.B
+    pause_requested := false.B
+    pausing := false.B
+    merging := false.B
+    merge_phase := mRead
+    merge_cntr := 0.U
+    for (record <- merge_records; value <- record) {
+      value := 0.U
+    }
+    recording := false.B
+    record_head := 0.U
+    record_tail := 0.U
+    record_dropped := 0.U
     bp_switch.io.X_in := 0.U
     bp_switch.io.Y_in := 0.U
     bp_switch.io.Z_in := 0.U
     bp_switch.io.size_in := 0.U
     bp_switch.io.m_in := 0.U
+    bp_switch.io.VX_in := 0.U
+    bp_switch.io.VY_in := 0.U
+    bp_switch.io.VZ_in := 0.U
     bp_switch.io.dt := 0.U
     state := s_idle
     internal_counter := 0.U
     substate_cntr := 0.U
+    compute_slot := 0.U
     last_valid_pckt_received_cnt := 0.U
+    dOut := NaN
   }
 
+  irq_pending := (irq_pending & ~irq_clear) | Cat(irq_tick_set, irq_collision_set, irq_done_set)
+
   // printf(p"----------------------\n")
   // printf(p"Command: ${binStr(command, 5)}\n")
   // printf(p"Key: ${binStr(key, 27)}\n")
@@ -365,4 +1246,17 @@ class CelestialTop(val BPE_num: Int) extends Module {
   // printf(p"substate_cntr: ${substate_cntr}\n")
 
 
-}
\ No newline at end of file
+}
+
+object CelestialTop {
+  // Registers of a partition in the Chipyard peripheral, partition p starts at p * partitionStride
+  val partitionStride = 0x100
+  val statusReg = 0x00
+  val dInReg = 0x04 // 64 bits, one packet per write
+  val dOutReg = 0x0C
+  val iterationReg = 0x10
+  val recordHeadReg = 0x14
+  val recordTailReg = 0x18
+  val recordDroppedReg = 0x1C
+  def partitionBase(partition: Int): Int = partition * partitionStride
+}
@@ -4,21 +4,26 @@ import chisel3._
 import chisel3.util._
 import chisel3.experimental._
 
-class F32Adder extends Module {
+// With stages, the sum is given stages cycles after the operands: the first register is placed after the alignment
+// and the addition, before the normalization, the others at the output. A new operation can still start every cycle
+class FPAdder(val format: FloatFormat, val stages: Int = 0) extends Module {
+  val width = format.width
+  val fracWidth = format.fracWidth
+
   val io = IO(new Bundle {
-    val a    = Input(UInt(32.W))
-    val b    = Input(UInt(32.W))
+    val a    = Input(UInt(width.W))
+    val b    = Input(UInt(width.W))
     val substracter = Input(Bool())
-    val sum  = Output(UInt(32.W))
+    val sum  = Output(UInt(width.W))
   })
   
   def unpackFloat(in: UInt): (Bool, UInt, UInt) = {
-    val sign     = in(31)
-    val exponent = in(30, 23)
+    val sign     = format.sign(in)
+    val exponent = format.exponent(in)
     // Add implicit leading 1 to fraction unless exponent and fraction are both zero
-    val fraction = Cat(1.U(1.W), in(22, 0)) // Implicit leading 1 for normalized numbers
-    val isZero   = (exponent === 0.U) && (in(22, 0) === 0.U)
-    val adjustedFraction = Mux(isZero, 0.U(24.W), fraction) // Set fraction to 0 if zero
+    val fraction = Cat(1.U(1.W), format.fraction(in)) // Implicit leading 1 for normalized numbers
+    val isZero   = (exponent === 0.U) && (format.fraction(in) === 0.U)
+    val adjustedFraction = Mux(isZero, 0.U((fracWidth + 1).W), fraction) // Set fraction to 0 if zero
     // Return sign, exponent, and fraction
     (sign, exponent, adjustedFraction)
   }
@@ -45,9 +50,9 @@ class F32Adder extends Module {
   val expDiff     = (expA -& expB).asSInt
   val expGreaterA = expDiff >= 0.S
 
-  val alignedFracA = Wire(UInt(24.W))
-  val alignedFracB = Wire(UInt(24.W))
-  val resultExp    = Wire(UInt(8.W))
+  val alignedFracA = Wire(UInt((fracWidth + 1).W))
+  val alignedFracB = Wire(UInt((fracWidth + 1).W))
+  val resultExp    = Wire(UInt(format.expWidth.W))
   val resultSign   = Wire(Bool())
   
   when (expGreaterA) {
@@ -62,10 +67,10 @@ class F32Adder extends Module {
 
   
   // Addition or subtraction based on signs
-  val sumRaw = Wire(SInt(25.W))
+  val sumRaw = Wire(SInt((fracWidth + 2).W))
   val extendedA = Cat(0.U(1.W), alignedFracA) // Add a 25th bit for the carry on
   val extendedB = Cat(0.U(1.W), alignedFracB)
-  val absSum = Wire(UInt(25.W))
+  val absSum = Wire(UInt((fracWidth + 2).W))
   when (signA === signB) {
     // printf("Adding...")
     sumRaw := (extendedA + extendedB).asSInt
@@ -79,7 +84,7 @@ class F32Adder extends Module {
     absSum := Mux(sumRaw < 0.S, -sumRaw, sumRaw).asUInt // Todo : make more efficient
   }
 
-  val result = Cat(resultSign, resultExp, absSum(22, 0))
+  val result = Cat(resultSign, resultExp, absSum(fracWidth - 1, 0))
 
 
   // === DEBUG PRINTS ===
@@ -95,80 +100,97 @@ class F32Adder extends Module {
   // printf(p"Sum Raw: 0b${Binary(sumRaw)}, Abs Sum: 0b${binStr(absSum,25)}\n")
 
  
-  val isZeroA = (expA === 0.U) && (fracA(22, 0) === 0.U)  // Check if A is zero
-  val isZeroB = (expB === 0.U) && (fracB(22, 0) === 0.U)  // Check if B is zero
+  val maxExp = format.maxExp.U
+  val isZeroA = (expA === 0.U) && (fracA(fracWidth - 1, 0) === 0.U)  // Check if A is zero
+  val isZeroB = (expB === 0.U) && (fracB(fracWidth - 1, 0) === 0.U)  // Check if B is zero
   // printf(p"Is Zero A: $isZeroA, Is Zero B: $isZeroB\n")
 
-  val isNaNA = (expA === 255.U) && !(fracA(22, 0) === 0.U) // Detect if A is NaN
-  val isNaNB = (expB === 255.U) && !(fracB(22, 0) === 0.U) // Detect if B is NaN
+  val isNaNA = (expA === maxExp) && !(fracA(fracWidth - 1, 0) === 0.U) // Detect if A is NaN
+  val isNaNB = (expB === maxExp) && !(fracB(fracWidth - 1, 0) === 0.U) // Detect if B is NaN
   // printf(p"Is NaN A: $isNaNA, Is NaN B: $isNaNB\n")
 
-  val isInfA = (expA === 255.U) && (fracA(22, 0) === 0.U) // Detect if A is Inf
-  val isInfB = (expB === 255.U) && (fracB(22, 0) === 0.U) // Detect if B is Inf
+  val isInfA = (expA === maxExp) && (fracA(fracWidth - 1, 0) === 0.U) // Detect if A is Inf
+  val isInfB = (expB === maxExp) && (fracB(fracWidth - 1, 0) === 0.U) // Detect if B is Inf
   // printf(p"Is Inf A: $isInfA, Is Inf B: $isInfB\n")
 
+  // Register before the normalization, when the unit is pipelined. The special cases are already decided
+  def cut[T <: Data](x: T): T = if (stages > 0) RegNext(x) else x
+  val special = WireDefault(0.U(width.W))
+  val isSpecial = WireDefault(true.B)
   when(isNaNA || isNaNB) {
     // printf(p"NaN detected, setting to NaN\n")
-    io.sum := Cat(resultSign, 255.U(8.W), 1.U(23.W)) // Set to NaN
+    special := Cat(resultSign, maxExp, 1.U(fracWidth.W)) // Set to NaN
   }. elsewhen(isInfA || isInfB) {
     // If the signs are the same, return infinity
     // If the signs are different, return NaN
     when (isInfA && !isInfB) {
       // printf(p"Infinity A detected\n")
       // Set to same infinity as A
-      io.sum := Cat(resultSign, 255.U(8.W), 0.U(23.W)) // Set to infinity
+      special := format.inf(resultSign) // Set to infinity
     } .elsewhen (isInfB && !isInfA) {
       // printf(p"Infinity B detected\n")
       // Set to same infinity as B
-      io.sum := Cat(resultSign, 255.U(8.W), 0.U(23.W)) // Set to infinity
+      special := format.inf(resultSign) // Set to infinity
     }. otherwise { //     when (isInfA && isInfB) 
       when (signB === signA) {
         // If the signs are the same, return infinity
         // printf(p"Converging infinity detected, setting to infinity\n")
-        io.sum := Cat(resultSign, 255.U(8.W), 0.U(23.W)) // Set to infinity
+        special := format.inf(resultSign) // Set to infinity
       } .otherwise {
         // printf(p"Diverging infinity detected, setting to NaN\n")
-        io.sum := Cat(resultSign, 255.U(8.W), 1.U(23.W)) // Set to NaN
+        special := Cat(resultSign, maxExp, 1.U(fracWidth.W)) // Set to NaN
       }
     }
  
 
   } .elsewhen(isZeroA && isZeroB) {
-    io.sum := 0.U  // Both inputs are zero, so the sum is zero
+    special := 0.U  // Both inputs are zero, so the sum is zero
   } .elsewhen(isZeroA) {
     // printf(p"Zero A detected, setting to B\n")
-    io.sum := Cat(signB, io.b(30,0)) // To handle the sign change if substracter mode
+    special := Cat(signB, io.b(width - 2, 0)) // To handle the sign change if substracter mode
   } .elsewhen(isZeroB) {
     // printf(p"Zero B detected, setting to A\n")
-    io.sum := io.a  // If B is zero, result is A
+    special := io.a  // If B is zero, result is A
+  } .otherwise {
+    isSpecial := false.B
+  }
+  val specialReg = cut(special)
+  val isSpecialReg = cut(isSpecial)
+  val absSumReg = cut(absSum)
+  val resultExpReg = cut(resultExp)
+  val resultSignReg = cut(resultSign)
+
+  val sum = Wire(UInt(width.W))
+  when (isSpecialReg) {
+    sum := specialReg
   } .otherwise { // None are zero
       // Normalize the result, in case during a subtraction the result no longer has a leading 1
     // Find the position of the leading 1
     // Use bool in reverse order
     // Priority returns the bit position of the least-significant high bit of the input -> reverse
-    val leadingZeros = PriorityEncoder(absSum.asBools.reverse) // Find the leading zeroes
+    val leadingZeros = PriorityEncoder(absSumReg.asBools.reverse) // Find the leading zeroes
     // printf(p"Leading Zeros: $leadingZeros\n")
     // Shift the result to normalize
-    val normalizedFrac = (absSum << leadingZeros)(24, 1) // Shift out the leading zeroes, and keep the 24 MSB
-    val normalizedExp = (resultExp - leadingZeros + 1.U)(7, 0) // +1 to account for the 25th carry on bit that was added, then gets removed as a leading zero
+    val normalizedFrac = (absSumReg << leadingZeros)(fracWidth + 1, 1) // Shift out the leading zeroes, and keep the 24 MSB
+    val normalizedExp = (resultExpReg - leadingZeros + 1.U)(format.expWidth - 1, 0) // +1 to account for the 25th carry on bit that was added, then gets removed as a leading zero
     // printf(p"Normalized Frac: 0b${binStr(normalizedFrac, 24)}\n")    
-    // printf(p"Remaining part of the frac in output: 0b${binStr(normalizedFrac(22, 0), 22)}\n")
+    // printf(p"Remaining part of the frac in output: 0b${binStr(normalizedFrac(fracWidth - 1, 0), 22)}\n")
     // printf(p"Result Exp: 0b${binStr(resultExp, 8)}\n")
     // printf(p"Normalized Exp: 0b${binStr(normalizedExp, 8)}\n")
     // Handle going to infinity
-    when ((resultExp === 255.U || normalizedExp  === 255.U) && normalizedFrac =/= 0.U) {
+    when ((resultExpReg === maxExp || normalizedExp  === maxExp) && normalizedFrac =/= 0.U) {
       // printf(p"Overflow detected, setting to infinity\n")
-      io.sum := Cat(resultSign, 255.U(8.W), 0.U(23.W)) // Set to infinity
+      sum := format.inf(resultSignReg) // Set to infinity
     } .elsewhen (normalizedFrac === 0.U) {
       // printf(p"Underflow detected, setting to zero\n")
-      io.sum := 0.U // Set to zero
+      sum := 0.U // Set to zero
     } .otherwise {
       // printf(p"Normal case, setting to normal value\n")
-      io.sum := Cat(resultSign, normalizedExp, normalizedFrac(22, 0))
+      sum := Cat(resultSignReg, normalizedExp, normalizedFrac(fracWidth - 1, 0))
     }
 
   }
-  
+  io.sum := ShiftRegister(sum, (stages - 1).max(0))
 
   // printf(p"Output (io.sum): 0b${binStr(io.sum, 32)}\n")
   //printf(p"Output (io.sum): 0b" + Binary(io.sum.pad(32)) + p"\n")
@@ -180,4 +202,7 @@ class F32Adder extends Module {
   // printf(p"Output: 0b${binStr(io.sum,32)}\n")
   // printf("====================================================\n")
 
-}
\ No newline at end of file
+}
+
+// Single precision adder
+class F32Adder(stages: Int = 0) extends FPAdder(FloatFormat.F32, stages)
@@ -3,10 +3,11 @@ package celestial
 import chisel3._
 import chisel3.util._
 
-class NegThreeHalfExpInitial extends Module {
+// Initial approximation of x^(-3/2), from the bits of the float seen as an integer
+class NegThreeHalfExpInitial(val format: FloatFormat = FloatFormat.F32) extends Module {
   val io = IO(new Bundle {
-    val in  = Input(UInt(32.W))
-    val out = Output(UInt(32.W))
+    val in  = Input(UInt(format.width.W))
+    val out = Output(UInt(format.width.W))
   })
   def binStr(x: UInt, width: Int): Printable = {
     var result: Printable = p""
@@ -17,7 +18,7 @@ class NegThreeHalfExpInitial extends Module {
   }
 
   // Constants
-  val magicNumber = "h9EADA9A8".U(32.W)
+  val magicNumber = format.negThreeHalfMagic.U(format.width.W)
 
   // Approximation
   val floatAsInt = io.in
@@ -27,19 +28,22 @@ class NegThreeHalfExpInitial extends Module {
 
 
 
-class NegThreeHalfExpRefine extends Module {
+// One Newton-Raphson pass, on a multiplier and an adder shared with NegThreeHalfExp
+// With stages, the units give their result stages cycles after their operands: each step holds its operands and waits
+// for the result, so a pass takes 4 * (stages + 1) cycles
+class NegThreeHalfExpRefine(val stages: Int = 0, val format: FloatFormat = FloatFormat.F32) extends Module {
   val io = IO(new Bundle {
-    val inExpThree = Input(UInt(32.W)) // original input x
-    val approx = Input(UInt(32.W)) // guess
-    val out = Output(UInt(32.W))
+    val inExpThree = Input(UInt(format.width.W)) // original input x
+    val approx = Input(UInt(format.width.W)) // guess
+    val out = Output(UInt(format.width.W))
     
-    val mulA = Output(UInt(32.W)) 
-    val mulB = Output(UInt(32.W)) 
-    val mulOut = Input(UInt(32.W))
+    val mulA = Output(UInt(format.width.W)) 
+    val mulB = Output(UInt(format.width.W)) 
+    val mulOut = Input(UInt(format.width.W))
 
-    val subA = Output(UInt(32.W))
-    val subB = Output(UInt(32.W))
-    val subOut = Input(UInt(32.W))
+    val subA = Output(UInt(format.width.W))
+    val subB = Output(UInt(format.width.W))
+    val subOut = Input(UInt(format.width.W))
 
     val rst = Input(Bool())
   })
@@ -59,37 +63,54 @@ class NegThreeHalfExpRefine extends Module {
   io.subA := 0.U
   io.subB := 0.U
 
-  val onePointFive = "h3FC00000".U(32.W)
+  val onePointFive = format.onePointFive
 
-  val temp = Reg(UInt(32.W))
+  val temp = Reg(UInt(format.width.W))
 
   val s1 :: s2 :: s3 :: s4 :: s5 :: Nil = Enum(5)
   val state = RegInit(s1)
 
+  // Cycles spent in the current step, its result is there when it reaches stages
+  val delay = RegInit(0.U(log2Ceil(stages + 1).max(1).W))
+  val ready = delay === stages.U
+  when (io.rst || ready || state === s5) {
+    delay := 0.U
+  } .otherwise {
+    delay := delay + 1.U
+  }
+
   switch(state) {
     is(s1) {
       io.mulA := io.approx
       io.mulB := io.inExpThree
-      temp := io.mulOut
-      state := s2
+      when (ready) {
+        temp := io.mulOut
+        state := s2
+      }
     }
     is(s2) {
       io.mulA := temp
       io.mulB := io.approx
-      temp := io.mulOut
-      state := s3
+      when (ready) {
+        temp := io.mulOut
+        state := s3
+      }
     }
     is(s3) {
       io.subA := onePointFive
-      io.subB := Cat(0.U(1.W), temp(30, 23) - 1.U, temp(22, 0)) // divide by 2
-      temp := io.subOut
-      state := s4
+      io.subB := Cat(0.U(1.W), format.exponent(temp) - 1.U, format.fraction(temp)) // divide by 2
+      when (ready) {
+        temp := io.subOut
+        state := s4
+      }
     }
     is(s4) {
       io.mulA := io.approx
       io.mulB := temp
-      state := s5
-      temp := io.mulOut
+      when (ready) {
+        state := s5
+        temp := io.mulOut
+      }
     }
     is(s5) {
       // Hold until new approx comes
@@ -103,12 +124,12 @@ class NegThreeHalfExpRefine extends Module {
   // Output logic
   //io.out := Cat(0.U(1.W), io.mulOut(30, 0))
   // Add a mux to output the result only when the state is s5
-  when (state === s4) {
-    io.out := Cat(0.U(1.W), io.mulOut(30, 0))
+  when (state === s4 && ready) {
+    io.out := Cat(0.U(1.W), io.mulOut(format.width - 2, 0))
   }. elsewhen (state === s5) {
-    io.out := Cat(0.U(1.W), temp(30, 0))
+    io.out := Cat(0.U(1.W), temp(format.width - 2, 0))
   }. otherwise {
-   io.out := 0.U(32.W)
+   io.out := 0.U(format.width.W)
   }
 
   // print("========================NegThreeHalfExpRefine============================\n")
@@ -119,20 +140,25 @@ class NegThreeHalfExpRefine extends Module {
 }
 
 
-class NegThreeHalfExp extends Module {
+// x^(-3/2) with the initial approximation and format.refinements Newton-Raphson passes, on a multiplier and an adder
+// given by the parent module. The result is given from count NegThreeHalfExp.done(stages, format), and held until the
+// next reset.
+// The multiplier and the adder must use format, and have the same register stages: x^2 and x^3 take stages + 1 cycles
+// each, and the passes wait for the units as well.
+class NegThreeHalfExp(val stages: Int = 0, val format: FloatFormat = FloatFormat.F32) extends Module {
     val io = IO(new Bundle {
-    val in  = Input(UInt(32.W))
+    val in  = Input(UInt(format.width.W))
     val rst = Input(Bool())
-    val out = Output(UInt(32.W))
+    val out = Output(UInt(format.width.W))
     
     
-    val mulA = Output(UInt(32.W)) 
-    val mulB = Output(UInt(32.W)) 
-    val mulOut = Input(UInt(32.W))
+    val mulA = Output(UInt(format.width.W)) 
+    val mulB = Output(UInt(format.width.W)) 
+    val mulOut = Input(UInt(format.width.W))
 
-    val subA = Output(UInt(32.W))
-    val subB = Output(UInt(32.W))
-    val subOut = Input(UInt(32.W))
+    val subA = Output(UInt(format.width.W))
+    val subB = Output(UInt(format.width.W))
+    val subOut = Input(UInt(format.width.W))
   })
   def binStr(x: UInt, width: Int): Printable = {
     var result: Printable = p""
@@ -143,17 +169,17 @@ class NegThreeHalfExp extends Module {
   }
   
 
-  val initial = Module(new NegThreeHalfExpInitial())
-  val refine = Module(new NegThreeHalfExpRefine())
+  val initial = Module(new NegThreeHalfExpInitial(format))
+  val refine = Module(new NegThreeHalfExpRefine(stages, format))
 
-  val sign = io.in(31)
-  val exponent = io.in(30, 23)
-  val fraction = io.in(22, 0)
+  val sign = format.sign(io.in)
+  val exponent = format.exponent(io.in)
+  val fraction = format.fraction(io.in)
   
   val connectRefinerToMulAndSub = RegInit(true.B)
   val isZero = (exponent === 0.U) && (fraction === 0.U)
-  val isInf = (exponent === 255.U) && (fraction === 0.U)
-  val isNaN = (exponent === 255.U) && (fraction =/= 0.U)
+  val isInf = (exponent === format.maxExp.U) && (fraction === 0.U)
+  val isNaN = (exponent === format.maxExp.U) && (fraction =/= 0.U)
   val isNegative = sign === 1.U && !isZero
 
   // Default assignments to avoid inferred latches
@@ -162,10 +188,16 @@ class NegThreeHalfExp extends Module {
   refine.io.inExpThree := 0.U
   refine.io.approx := 0.U
   refine.io.rst := false.B
-  
-  val count = RegInit(0.U(4.W)) // 4 bits to count up to 16
-  val xEThree = RegInit(0.U(32.W))
-  val temp = RegInit(0.U(32.W))
+
+  // Counts of the steps: x^3 is there at cubeDone, then each pass ends passCycles later
+  val cubeDone = 2 * stages
+  val passCycles = 4 * (stages + 1)
+  val passes = format.refinements
+  val done = NegThreeHalfExp.done(stages, format)
+
+  val count = RegInit(0.U(log2Ceil(done + 2).W)) // Stops at done + 1, once the result is held in temp
+  val xEThree = RegInit(0.U(format.width.W))
+  val temp = RegInit(0.U(format.width.W))
 
   // Set the default value of the outputs
   io.mulA := 0.U
@@ -173,7 +205,7 @@ class NegThreeHalfExp extends Module {
   io.subA := 0.U
   io.subB := 0.U
 
-  io.out := 0.U(32.W)
+  io.out := 0.U(format.width.W)
 
 
   when (connectRefinerToMulAndSub) {
@@ -187,95 +219,65 @@ class NegThreeHalfExp extends Module {
   refine.io.subOut := io.subOut
 
   when ((isNegative || isNaN) && io.rst === false.B) {
-    io.out  := "h7FC00000".U // NaN
+    io.out  := format.nan // NaN
   } .elsewhen (isZero && io.rst === false.B) {
-    io.out  := "h7F800000".U // +Inf
+    io.out  := format.inf(false.B) // +Inf
   } .elsewhen (isInf && io.rst === false.B) {
     io.out  := 0.U // 1/sqrt(Inf) = 0
   } .otherwise {
     refine.io.inExpThree := xEThree
 
-    when (count === 12.U)
+    when (count === done.U)
     {
       io.out := refine.io.out
-    }.elsewhen (count >= 13.U) {
+    }.elsewhen (count > done.U) {
       io.out := temp
     }.otherwise {
-      io.out := 0.U(32.W)
+      io.out := 0.U(format.width.W)
     }
 
     when (io.rst)
     {
       // Already start the computation when reseting. 
-      // The refine step uses x^3, so we need to compute x^2 first, which is then multiplied by x to get x^3 at count 0
+      // The refine step uses x^3, so we need to compute x^2 first, which is then multiplied by x to get x^3
         io.mulA := io.in
         io.mulB := io.in
-        temp := io.mulOut
+        if (stages == 0) {
+          temp := io.mulOut
+        }
         connectRefinerToMulAndSub := false.B
-    }
-
-    // Switch over the counter to determine which refinement to use
-    switch (count) {
-      is(0.U) {
-        // Finish the computation of x^3 before the first refinement
+    } .otherwise {
+      if (stages > 0) {
+        when (count === (stages - 1).U) {
+          temp := io.mulOut // x^2
+        }
+      }
+      when (count === stages.U) {
+        // Start the computation of x^3 before the first refinement
         io.mulA := temp
         io.mulB := io.in
+      }
+      when (count === cubeDone.U) {
         xEThree := io.mulOut
         refine.io.rst := true.B
         connectRefinerToMulAndSub := true.B
       }
-      is(1.U) {
-        // First refinement
-        refine.io.approx := initial.io.out
-        // Wire the inputs to the multiplier and subtracter
-        refine.io.rst := false.B
-      }
-      is(2.U) {
-        // Wait for the first refinement to finish (4 cycles)
-        refine.io.approx := initial.io.out
-      }
-      is(3.U) {
-        refine.io.approx := initial.io.out
-      }
-      is(4.U) {
+
+      // First refinement from the initial approximation, the next ones from the previous result
+      when (count > cubeDone.U && count <= (cubeDone + passCycles).U) {
         refine.io.approx := initial.io.out
-        temp := refine.io.out
-        refine.io.rst := true.B
-      }
-      is(5.U) {
-        // Second refinement
-        refine.io.approx := temp  
-        refine.io.rst := false.B
-      }
-      is(6.U) {
+      } .elsewhen (count > (cubeDone + passCycles).U) {
         refine.io.approx := temp
       }
-      is(7.U) {
-        // Wait for the second refinement to finish (4 cycles)
-        refine.io.approx := temp
-      }  
-      is(8.U) {
-        refine.io.rst := true.B
-        temp := refine.io.out
-        refine.io.approx := temp
-      }
-      is(9.U) {
-        refine.io.approx := temp
-        refine.io.rst := false.B
+      // Keep the result at the end of each pass, and start the next one
+      for (pass <- 1 to passes) {
+        when (count === (cubeDone + pass * passCycles).U) {
+          temp := refine.io.out
+          if (pass < passes) {
+            refine.io.rst := true.B
+          }
+        }
       }
-      is(10.U) {
-        refine.io.approx := temp
-      }
-      is(11.U) {
-        // Third refinement
-        refine.io.approx := temp
-      }
-      is(12.U) {
-        temp := refine.io.out
-        refine.io.approx := temp
-      }
-      
-
     }
 
     // printf("======NetThreeExp==============================================\n")
@@ -294,11 +296,16 @@ class NegThreeHalfExp extends Module {
     count := 0.U
   } .otherwise {
     // Increase unless already at max value
-    when (count < 31.U) {
+    when (count <= done.U) {
       count := count + 1.U
     }
   }
 
   // Wire io.out to the result of refine2 to get the final output faster
   // io.out := refine2.io.out
-}
\ No newline at end of file
+}
+
+object NegThreeHalfExp {
+  // Count at which the result is given: x^2 and x^3, then the passes of four steps
+  def done(stages: Int, format: FloatFormat = FloatFormat.F32): Int = 2 * stages + format.refinements * 4 * (stages + 1)
+}
@@ -0,0 +1,127 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// Fused multiply-add: out = c + a * b, or c - a * b when negate is set
+// The product is kept at full precision, so the result is only truncated once, unlike F32Multiplier then F32Adder
+// As in the other units, the result is truncated and subnormal numbers are flushed to zero
+// With stages, the result is given stages cycles after the operands: the first register is placed after the
+// addition, before the normalization, the others at the output. A new operation can still start every cycle
+class FPFMA(val format: FloatFormat, val stages: Int = 0) extends Module {
+  val width = format.width
+  val fracWidth = format.fracWidth
+  // Width of the aligned operands: the product, and fracWidth + 3 more bits at the bottom
+  val alignedWidth = 3 * fracWidth + 5
+
+  val io = IO(new Bundle {
+    val a      = Input(UInt(width.W))
+    val b      = Input(UInt(width.W))
+    val c      = Input(UInt(width.W))
+    val negate = Input(Bool())
+    val out    = Output(UInt(width.W))
+  })
+
+  def unpackFloat(in: UInt): (Bool, UInt, UInt) = {
+    val sign     = format.sign(in)
+    val exponent = format.exponent(in)
+    val fraction = format.fraction(in)
+    val mantissa = Mux(exponent === 0.U, 0.U((fracWidth + 1).W), Cat(1.U(1.W), fraction)) // Subnormals are flushed to zero
+    (sign, exponent, mantissa)
+  }
+
+  val (signA, expA, mantA) = unpackFloat(io.a)
+  val (signB, expB, mantB) = unpackFloat(io.b)
+  val (signC, expC, mantC) = unpackFloat(io.c)
+  val signP = signA ^ signB ^ io.negate
+
+  val maxExp = format.maxExp.U
+  val isNaNA = (expA === maxExp) && (format.fraction(io.a) =/= 0.U)
+  val isNaNB = (expB === maxExp) && (format.fraction(io.b) =/= 0.U)
+  val isNaNC = (expC === maxExp) && (format.fraction(io.c) =/= 0.U)
+  val isInfA = (expA === maxExp) && (format.fraction(io.a) === 0.U)
+  val isInfB = (expB === maxExp) && (format.fraction(io.b) === 0.U)
+  val isInfC = (expC === maxExp) && (format.fraction(io.c) === 0.U)
+  val isZeroA = expA === 0.U
+  val isZeroB = expB === 0.U
+  val isZeroC = expC === 0.U
+
+  // Both operands on the same scale: the 48 bits product, and c shifted to the position of the product's leading one,
+  // with 26 more bits at the bottom to keep the bits of the smaller operand that are shifted out during the alignment
+  // (in single precision, 74 bits in total)
+  val product = Cat(mantA * mantB, 0.U((fracWidth + 3).W))
+  val addend = Mux(isZeroC, 0.U(alignedWidth.W), Cat(0.U(1.W), mantC, 0.U((2 * fracWidth + 3).W)))
+  val expP = expA.zext +& expB.zext - format.bias.S
+  val expDiff = expP - expC.zext
+  val productLarger = expDiff >= 0.S || isZeroC
+  val shiftRaw = Mux(expDiff >= 0.S, expDiff, -expDiff).asUInt
+  val shift = Mux(shiftRaw > alignedWidth.U, alignedWidth.U, shiftRaw)
+
+  val alignedP = Mux(productLarger, product, product >> shift)
+  val alignedC = Mux(productLarger, addend >> shift, addend)
+  val resultExp = Mux(productLarger, expP, expC.zext)
+
+  // Addition or subtraction of the magnitudes, with one more bit for the carry
+  val absSum = Wire(UInt((alignedWidth + 1).W))
+  val resultSign = Wire(Bool())
+  when (signP === signC) {
+    absSum := alignedP +& alignedC
+    resultSign := signP
+  } .elsewhen (alignedP >= alignedC) {
+    absSum := alignedP - alignedC
+    resultSign := signP
+  } .otherwise {
+    absSum := alignedC - alignedP
+    resultSign := signC
+  }
+
+  // Register before the normalization, when the unit is pipelined. The special cases are already decided
+  def cut[T <: Data](x: T): T = if (stages > 0) RegNext(x) else x
+  val special = WireDefault(0.U(width.W))
+  val isSpecial = WireDefault(true.B)
+  when (isNaNA || isNaNB || isNaNC || (isInfA && isZeroB) || (isInfB && isZeroA)) {
+    special := format.nan // NaN
+  } .elsewhen (isInfA || isInfB) {
+    when (isInfC && signC =/= signP) {
+      special := format.nan // Inf - Inf
+    } .otherwise {
+      special := format.inf(signP)
+    }
+  } .elsewhen (isInfC) {
+    special := format.inf(signC)
+  } .elsewhen (isZeroA || isZeroB) {
+    special := Mux(isZeroC, 0.U, io.c) // Nothing to add to c
+  } .otherwise {
+    isSpecial := false.B
+  }
+  val specialReg = cut(special)
+  val isSpecialReg = cut(isSpecial)
+  val absSumReg = cut(absSum)
+  val resultExpReg = cut(resultExp)
+  val resultSignReg = cut(resultSign)
+
+  // Normalize, the leading one is moved to the top bit (74 in single precision) and the next fracWidth bits are kept
+  val leadingZeros = PriorityEncoder(absSumReg.asBools.reverse)
+  val normalized = (absSumReg << leadingZeros)(alignedWidth, 0)
+  val normalizedExp = resultExpReg + 2.S - leadingZeros.zext
+  val truncatedExp = normalizedExp.asUInt
+
+  val result = WireDefault(0.U(width.W))
+
+  when (isSpecialReg) {
+    result := specialReg
+  } .elsewhen (absSumReg === 0.U) {
+    result := 0.U
+  } .elsewhen (normalizedExp >= format.maxExp.S) {
+    result := format.inf(resultSignReg) // Overflow -> Infinity
+  } .elsewhen (normalizedExp <= 0.S) {
+    result := 0.U // Underflow
+  } .otherwise {
+    result := Cat(resultSignReg, truncatedExp(format.expWidth - 1, 0), normalized(alignedWidth - 1, alignedWidth - fracWidth))
+  }
+
+  io.out := ShiftRegister(result, (stages - 1).max(0))
+}
+
+// Single precision fused multiply-add unit
+class F32FMA(stages: Int = 0) extends FPFMA(FloatFormat.F32, stages)
@@ -0,0 +1,53 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// IEEE-754 binary format of the arithmetic units and of the BPUs' records: 1 sign bit, expWidth bits of exponent and
+// fracWidth bits of fraction. The units are written for any format, F32Multiplier, F32FMA and F32Adder are the
+// single precision ones used by the rest of the accelerator
+case class FloatFormat(expWidth: Int, fracWidth: Int) {
+  val width = 1 + expWidth + fracWidth
+  val bias = (1 << (expWidth - 1)) - 1
+  val maxExp = (1 << expWidth) - 1
+  // Words of 32 bits per value, on the host interface and on the DMA
+  val words = (width + 31) / 32
+  // Newton-Raphson passes of x^(-3/2) to reach the precision of the format from the 7% initial approximation, each
+  // pass doubles the correct bits: the third one is 1.2e-8 off, the fourth one reaches double precision
+  val refinements = if (fracWidth <= 23) 3 else 4
+
+  def one: UInt = (BigInt(bias) << fracWidth).U(width.W)
+  def onePointFive: UInt = ((BigInt(bias) << fracWidth) | (BigInt(1) << (fracWidth - 1))).U(width.W)
+  def nan: UInt = ((BigInt(maxExp) << fracWidth) | (BigInt(1) << (fracWidth - 1))).U(width.W) // Quiet NaN
+  def inf(sign: Bool): UInt = Cat(sign, maxExp.U(expWidth.W), 0.U(fracWidth.W))
+
+  // Magic constant of the initial x^(-3/2) approximation, 5/2 * 2^fracWidth * (bias - sigma). The sigma of the
+  // single precision constant 0x9EADA9A8 is kept, so the relative error of the approximation is the same
+  def negThreeHalfMagic: BigInt =
+    (BigInt(0x9EADA9A8L) << (fracWidth - 23)) + (BigInt(5) << (fracWidth - 1)) * (bias - 127)
+  // Same for the initial approximations of 1/x, magic - x, and of x^(-1/3), magic - x / 3, used by the collision
+  // merge: 5% off, the passes of refinements reach the precision of the format as well
+  def reciprocalMagic: BigInt = (BigInt(2 * bias) << fracWidth) - (BigInt(0xCEE39) << (fracWidth - 23))
+  def invCubeRootMagic: BigInt = (BigInt(4 * bias) << fracWidth) / 3 - (BigInt(0x7B01E) << (fracWidth - 23))
+
+  def sign(x: UInt): Bool = x(width - 1)
+  def exponent(x: UInt): UInt = x(width - 2, fracWidth)
+  def fraction(x: UInt): UInt = x(fracWidth - 1, 0)
+
+  // x * 2^shift, by adding shift to the exponent: exact, unless the result leaves the range of the format. As in the
+  // units, it then overflows to infinity or is flushed to zero. Zeros, infinities and NaNs are kept as they are
+  def scale(x: UInt, shift: SInt): UInt = {
+    val exp = exponent(x)
+    val scaled = exp.zext +& shift
+    val scaledBits = scaled.asUInt
+    MuxCase(Cat(sign(x), scaledBits(expWidth - 1, 0), fraction(x)), Seq(
+      (exp === 0.U || exp === maxExp.U) -> x,
+      (scaled >= maxExp.S) -> inf(sign(x)),
+      (scaled <= 0.S) -> 0.U(width.W)))
+  }
+}
+
+object FloatFormat {
+  val F32 = FloatFormat(8, 23)
+  val F64 = FloatFormat(11, 52)
+}
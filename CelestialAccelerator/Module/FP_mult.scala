@@ -3,22 +3,28 @@ package celestial
 import chisel3._
 import chisel3.util._
 
-class F32Multiplier extends Module {
+// With stages, the result is given stages cycles after the operands: the first register is placed after the product
+// of the mantissas, the others at the output. A new product can still start every cycle
+class FPMultiplier(val format: FloatFormat, val stages: Int = 0) extends Module {
+  val width = format.width
+  val fracWidth = format.fracWidth
+  val productWidth = 2 * (fracWidth + 1)
+
   val io = IO(new Bundle {
-    val a   = Input(UInt(32.W))
-    val b   = Input(UInt(32.W))
-    val out = Output(UInt(32.W))
+    val a   = Input(UInt(width.W))
+    val b   = Input(UInt(width.W))
+    val out = Output(UInt(width.W))
   })
 
-  val bias = 127.U(8.W)
+  val bias = format.bias.U(format.expWidth.W)
 
   def unpackFloat(in: UInt): (Bool, UInt, UInt) = {
-    val sign     = in(31)
-    val exponent = in(30, 23)
-    val fraction = in(22, 0)
+    val sign     = format.sign(in)
+    val exponent = format.exponent(in)
+    val fraction = format.fraction(in)
     val isZero   = (exponent === 0.U) && (fraction === 0.U)
     val mantissa = Mux(exponent === 0.U, Cat(0.U(1.W), fraction), Cat(1.U(1.W), fraction))
-    (sign, exponent, Mux(isZero, 0.U(24.W), mantissa))
+    (sign, exponent, Mux(isZero, 0.U((fracWidth + 1).W), mantissa))
   }
   
   def binStr(x: UInt, width: Int): Printable = {
@@ -32,44 +38,48 @@ class F32Multiplier extends Module {
   val (signA, expA, mantA) = unpackFloat(io.a)
   val (signB, expB, mantB) = unpackFloat(io.b)
 
-  val signRes = signA ^ signB
+  // Register after the product, when the multiplier is pipelined
+  def cut[T <: Data](x: T): T = if (stages > 0) RegNext(x) else x
+
+  val signRes = cut(signA ^ signB)
 
   //val expSum = expA +& expB - bias
-  val expSum = Mux(expA +& expB > bias, expA +& expB - bias, 0.U(8.W))
-  val mantProduct = (mantA * mantB)(47, 0)
+  val expSum = cut(Mux(expA +& expB > bias, expA +& expB - bias, 0.U(format.expWidth.W)))
+  val mantProduct = cut((mantA * mantB)(productWidth - 1, 0))
 
   val leadingOne = PriorityEncoder(mantProduct.asBools.reverse)
-  val normalizedMantissa = (mantProduct << (leadingOne))(47, 0)
-  val finalMantissa = normalizedMantissa(46, 24)
+  val normalizedMantissa = (mantProduct << (leadingOne))(productWidth - 1, 0)
+  val finalMantissa = normalizedMantissa(productWidth - 2, fracWidth + 1)
   val adjustedExp = (expSum - leadingOne + 1.U)
-  val truncated_adjustedExp = adjustedExp(7, 0)
-  val isNaNA = (expA === 255.U) && (mantA(22, 0) =/= 0.U)
-  val isNaNB = (expB === 255.U) && (mantB(22, 0) =/= 0.U)
-  val isInfA = (expA === 255.U) && (mantA(22, 0) === 0.U)
-  val isInfB = (expB === 255.U) && (mantB(22, 0) === 0.U)
-  val isZeroA = (expA === 0.U) && (mantA(22, 0) === 0.U)
-  val isZeroB = (expB === 0.U) && (mantB(22, 0) === 0.U)
+  val truncated_adjustedExp = adjustedExp(format.expWidth - 1, 0)
+  val maxExp = format.maxExp.U
+  val isNaNA = cut((expA === maxExp) && (mantA(fracWidth - 1, 0) =/= 0.U))
+  val isNaNB = cut((expB === maxExp) && (mantB(fracWidth - 1, 0) =/= 0.U))
+  val isInfA = cut((expA === maxExp) && (mantA(fracWidth - 1, 0) === 0.U))
+  val isInfB = cut((expB === maxExp) && (mantB(fracWidth - 1, 0) === 0.U))
+  val isZeroA = cut((expA === 0.U) && (mantA(fracWidth - 1, 0) === 0.U))
+  val isZeroB = cut((expB === 0.U) && (mantB(fracWidth - 1, 0) === 0.U))
 
-  val result = WireDefault(0.U(32.W))
+  val result = WireDefault(0.U(width.W))
 
   when (isNaNA || isNaNB || (isInfA && isZeroB) || (isInfB && isZeroA)) {
-    result := "h7FC00000".U // NaN
+    result := format.nan // NaN
   } .elsewhen (isInfA || isInfB) {
-    result := Cat(signRes, 255.U(8.W), 0.U(23.W)) // Infinity
+    result := format.inf(signRes) // Infinity
   } .elsewhen (isZeroA || isZeroB) {
     result := 0.U // Zero
   } .otherwise {
-    when (adjustedExp >= 255.U) {
-      result := Cat(signRes, 255.U(8.W), 0.U(23.W)) // Overflow -> Infinity
+    when (adjustedExp >= maxExp) {
+      result := format.inf(signRes) // Overflow -> Infinity
     } .elsewhen (adjustedExp < 1.U) {
       // Underflow
       result := 0.U
     } .otherwise {
-      result := Cat(signRes, truncated_adjustedExp, finalMantissa(22, 0))
+      result := Cat(signRes, truncated_adjustedExp, finalMantissa(fracWidth - 1, 0))
     }
   }
 
-  io.out := result
+  io.out := ShiftRegister(result, (stages - 1).max(0))
 
   // Debugging information
   // Print the two inputs in binary
@@ -86,3 +96,6 @@ class F32Multiplier extends Module {
   // printf(p"Final Result: ${binStr(result, 32)}\n")
 
 }
+
+// Single precision multiplier
+class F32Multiplier(stages: Int = 0) extends FPMultiplier(FloatFormat.F32, stages)
@@ -0,0 +1,88 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// x^(-3/2) from a table of quadratic polynomials, instead of the initial approximation and its Newton-Raphson passes
+// x = 2^E * m, where the last bit of E is moved to m so that E is even and m is in [1, 4), then
+// x^(-3/2) = 2^(-3E/2) * m^(-3/2), where the power of 2 only changes the exponent.
+// m^(-3/2) is interpolated on segments selected by the parity of E and the first bits of the fraction, as
+// c0 - t * (c1 - t * c2) in fixed point, with t the other bits of the fraction.
+// Two stages: the table and the inner term, then the outer term and the packing of the float.
+// As in the other units, the result is truncated and subnormal numbers are flushed to zero
+class NegThreeHalfExpTable extends Module {
+  import NegThreeHalfExpTable._
+
+  val io = IO(new Bundle {
+    val in  = Input(UInt(32.W))
+    val out = Output(UInt(32.W))
+  })
+
+  val sign = io.in(31)
+  val exponent = io.in(30, 23)
+  val fraction = io.in(22, 0)
+
+  val isZero = exponent === 0.U
+  val isInf = (exponent === 255.U) && (fraction === 0.U)
+  val isNaN = (exponent === 255.U) && (fraction =/= 0.U)
+  val isNegative = sign === 1.U && !isZero
+
+  // E = exponent - 127 is odd when the biased exponent is even
+  val odd = !exponent(0)
+  val index = Cat(odd, fraction(22, tBits))
+  val t = fraction(tBits - 1, 0)
+
+  val c0 = VecInit(coefficients.map(_._1.U(fracBits.W)))(index)
+  val c1 = VecInit(coefficients.map(_._2.U(c1Width.W)))(index)
+  val c2 = VecInit(coefficients.map(_._3.U(c2Width.W)))(index)
+
+  // Stage 1: c1 - t * c2, and -3E/2 = 3 * (127 + odd - exponent) / 2, where the division is exact
+  val inner = RegNext(c1 - ((c2 * t) >> tBits))
+  val c0_reg = RegNext(c0)
+  val t_reg = RegNext(t)
+  val scale = RegNext(((127.S(11.W) + odd.zext - exponent.zext) >> 1) * 3.S)
+  val special = RegNext(MuxCase(0.U(2.W), Seq(
+    (isNegative || isNaN) -> 1.U,
+    isZero -> 2.U,
+    isInf -> 3.U)))
+
+  // Stage 2: m^(-3/2) is in (1/8, 1], the leading one is moved to the first bit of the fixed point value
+  val y = (c0_reg - ((inner * t_reg) >> tBits))(fracBits - 1, 0)
+  val top = Log2(y)
+  val normalized = (y << ((fracBits - 1).U - top))(fracBits - 1, 0)
+  val resultExp = scale + 127.S + top.zext - fracBits.S
+
+  io.out := MuxCase(Cat(0.U(1.W), resultExp(7, 0), normalized(fracBits - 2, fracBits - 24)), Seq(
+    (special === 1.U) -> "h7FC00000".U(32.W), // NaN
+    (special === 2.U) -> "h7F800000".U(32.W), // +Inf
+    (special === 3.U) -> 0.U(32.W), // 1/sqrt(Inf) = 0
+    (resultExp >= 255.S) -> "h7F800000".U(32.W), // Overflow -> Infinity
+    (resultExp <= 0.S) -> 0.U(32.W))) // Underflow
+}
+
+object NegThreeHalfExpTable {
+  // 2 * 2^indexBits segments, for the two parities of E. With 7 bits, the worst relative error is about 1.3e-7, below
+  // the 2e-7 of three Newton-Raphson passes
+  val indexBits = 7
+  val tBits = 23 - indexBits
+  val fracBits = 28 // Fixed point position of the coefficients and of m^(-3/2)
+  val latency = 2
+
+  // Quadratic through the Chebyshev nodes of each segment, m = start + t * width with t in [0, 1)
+  val coefficients: Seq[(BigInt, BigInt, BigInt)] = for (odd <- 0 to 1; i <- 0 until (1 << indexBits)) yield {
+    val width = (if (odd == 1) 2.0 else 1.0) / (1 << indexBits)
+    val start = (if (odd == 1) 2.0 else 1.0) + i * width
+    val nodes = (0 until 3).map(k => 0.5 - 0.5 * math.cos((2 * k + 1) * math.Pi / 6))
+    val values = nodes.map(t => math.pow(start + t * width, -1.5))
+    // Lagrange basis, expanded as a + b * t + c * t^2
+    val terms = for (k <- 0 until 3) yield {
+      val Seq(p, q) = nodes.patch(k, Nil, 1)
+      val d = (nodes(k) - p) * (nodes(k) - q)
+      (values(k) * p * q / d, -values(k) * (p + q) / d, values(k) / d)
+    }
+    def fixed(x: Double): BigInt = BigInt(math.round(x * (1L << fracBits)))
+    (fixed(terms.map(_._1).sum), fixed(-terms.map(_._2).sum), fixed(terms.map(_._3).sum))
+  }
+  val c1Width = coefficients.map(_._2.bitLength).max
+  val c2Width = coefficients.map(_._3.bitLength).max
+}
@@ -0,0 +1,73 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// 1/x, by a long division of the mantissas that gives one bit of the quotient per cycle. The result is given
+// fracWidth + 2 cycles after start, when busy falls, or at the next cycle for the powers of 2 and the special values.
+// It is held until the next start, which can come at any time
+// As in the other units, the result is truncated and subnormal numbers are flushed to zero
+// Meant for a value that rarely changes, such as the factor of the masses, where a divider would be too large
+class FPReciprocal(val format: FloatFormat) extends Module {
+  val width = format.width
+  val fracWidth = format.fracWidth
+
+  val io = IO(new Bundle {
+    val in    = Input(UInt(width.W))
+    val start = Input(Bool())
+    val out   = Output(UInt(width.W))
+    val busy  = Output(Bool())
+  })
+
+  val maxExp = format.maxExp.U
+  val result = RegInit(format.one) // 1/1 until the first operation
+  val sign = RegInit(false.B)
+  val exp = RegInit(0.U(format.expWidth.W))
+  val divisor = RegInit(0.U((fracWidth + 1).W)) // Mantissa of x, 1 <= m < 2
+  val remainder = RegInit(0.U((fracWidth + 2).W)) // Always below 2 * divisor
+  val quotient = RegInit(0.U((fracWidth + 2).W)) // 1/m, with the bit of 1 on top, then fracWidth + 1 bits
+  val steps = RegInit(0.U(log2Ceil(fracWidth + 3).W)) // Bits of the quotient still to compute
+
+  io.out := result
+  io.busy := steps =/= 0.U
+
+  when (steps =/= 0.U) {
+    val fits = remainder >= divisor
+    val bits = Cat(quotient(fracWidth, 0), fits)
+    quotient := bits
+    remainder := (Mux(fits, remainder - divisor, remainder) << 1)(fracWidth + 1, 0)
+    steps := steps - 1.U
+    when (steps === 1.U) {
+      // 1/x = 1/m * 2^(bias - e): only m = 1 gives a quotient of 1, the others are below 1 and take one more bit
+      val exact = bits(fracWidth + 1)
+      val resultExp = (2 * format.bias).S - exp.zext - Mux(exact, 0.S, 1.S)
+      val fraction = Mux(exact, 0.U(fracWidth.W), bits(fracWidth - 1, 0))
+      result := Mux(resultExp <= 0.S, 0.U(width.W), Cat(sign, resultExp.asUInt(format.expWidth - 1, 0), fraction))
+    }
+  }
+
+  when (io.start) {
+    val inExp = format.exponent(io.in)
+    val inFrac = format.fraction(io.in)
+    sign := format.sign(io.in)
+    exp := inExp
+    divisor := Cat(1.U(1.W), inFrac)
+    remainder := (BigInt(1) << fracWidth).U // 1, the first bit of the quotient
+    quotient := 0.U
+    steps := (fracWidth + 2).U
+    // Zeros and subnormals give infinities, infinities give zeros and NaNs stay NaNs, without a division
+    // The powers of 2, such as 1 after a reset, only need their exponent negated
+    val powerExp = (2 * format.bias).S - inExp.zext
+    when (inExp === 0.U) {
+      result := format.inf(format.sign(io.in))
+      steps := 0.U
+    } .elsewhen (inExp === maxExp) {
+      result := Mux(inFrac === 0.U, Cat(format.sign(io.in), 0.U((width - 1).W)), format.nan)
+      steps := 0.U
+    } .elsewhen (inFrac === 0.U) {
+      result := Mux(powerExp <= 0.S, 0.U(width.W),
+        Cat(format.sign(io.in), powerExp.asUInt(format.expWidth - 1, 0), 0.U(fracWidth.W)))
+      steps := 0.U
+    }
+  }
+}
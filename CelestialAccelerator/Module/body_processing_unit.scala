@@ -3,25 +3,67 @@ package celestial
 import chisel3._
 import chisel3.util._
 
-class BPU extends Module {
-  val io = IO(new Bundle {
-    val X_in  = Input(UInt(32.W))
-    val Y_in  = Input(UInt(32.W))
-    val Z_in  = Input(UInt(32.W))
+class BPU(val bodies: Int = 1, val pipelined: Boolean = false, val lanes: Int = 1, val symmetric: Boolean = false,
+          val tableSeed: Boolean = false, val unitStages: Int = 0,
+          val format: FloatFormat = FloatFormat.F32) extends Module {
+  // Number of bits needed to address the bank of body records
+  val slot_width = log2Ceil(bodies).max(1)
+  // Width of the records and of the values on the inputs and outputs
+  val width = format.width
+  require(!tableSeed || format == FloatFormat.F32, "NegThreeHalfExpTable only gives single precision seeds")
+  // The next velocity update of a record loads the velocity stored by the previous one, a window later, or at the
+  // next cycle in the pipelined variant
+  require(!pipelined || unitStages == 0, "The pipelined BPU accumulates at every cycle, its units can't have stages")
+  require(BPU.refinementPasses(format).forall(passes =>
+      unitStages < BPU.velocityWindow(lanes, symmetric, passes, tableSeed, format)),
+    "The units must give their result within the velocity update window")
 
-    val m_in  = Input(UInt(32.W))
-    val dt    = Input(UInt(32.W))
-    val m_slct = Input(UInt(3.W))
+  val io = IO(new Bundle {
+    val X_in  = Input(UInt(width.W))
+    val Y_in  = Input(UInt(width.W))
+    val Z_in  = Input(UInt(width.W))
+
+    val m_in  = Input(UInt(width.W))
+    val dt    = Input(UInt(width.W))
+    val m_slct = Input(UInt(4.W))
+
+    // Velocity, only used when loading a full body at once
+    val VX_in = Input(UInt(width.W))
+    val VY_in = Input(UInt(width.W))
+    val VZ_in = Input(UInt(width.W))
     
-    val size_in = Input(UInt(32.W))
+    val size_in = Input(UInt(width.W))
+
+    // Virtual bodies: the BPU holds a bank of records, only one of them is updated at a time
+    val slot = Input(UInt(slot_width.W)) // Record updated or set
+    val out_slot = Input(UInt(slot_width.W)) // Record driven on the outputs
+    val sync = Input(Bool()) // Restart the sub state counter, high at the first cycle of each update
+    val source = Input(UInt(width.W)) // Index of the broadcast body, kept as the partner of a collision
+    val refinements = Input(UInt(BPU.refinementsWidth(format).W)) // Newton-Raphson passes of the velocity update, up to BPU.maxRefinementsFor(format)
     
-    val X_out = Output(UInt(32.W))
-    val Y_out = Output(UInt(32.W))
-    val Z_out = Output(UInt(32.W))
-    val m_out = Output(UInt(32.W))
+    val X_out = Output(UInt(width.W))
+    val Y_out = Output(UInt(width.W))
+    val Z_out = Output(UInt(width.W))
+    val m_out = Output(UInt(width.W))
   
-    val size_out = Output(UInt(32.W))
+    val size_out = Output(UInt(width.W))
     val collided = Output(Bool())
+    val collided_slot = Output(UInt(slot_width.W)) // First record of the bank that collided
+    val collided_source = Output(UInt(width.W)) // Broadcast body it collided with
+    val busy = Output(Bool()) // The bank is being cleared
+    val pipeline_busy = Output(Bool()) // Velocity updates are still in flight
+
+    // Symmetric pairs only: reaction of the record updated by the velocity update, for the broadcast body
+    val reaction_X = Output(UInt(width.W))
+    val reaction_Y = Output(UInt(width.W))
+    val reaction_Z = Output(UInt(width.W))
+    val reaction_valid = Output(Bool())
+    // Sum of the reactions for one of the records of this BPU, added to its bank
+    val reaction_in_X = Input(UInt(width.W))
+    val reaction_in_Y = Input(UInt(width.W))
+    val reaction_in_Z = Input(UInt(width.W))
+    val reaction_in_valid = Input(Bool())
+    val reaction_slot = Input(UInt(slot_width.W))
   })
   def binStr(x: UInt, width: Int): Printable = {
     var result: Printable = p""
@@ -33,14 +75,14 @@ class BPU extends Module {
 
   // Used for the collision detection
   def compareFloats(a: UInt, b: UInt): Bool = { //a -> dist, b -> size
-    val signA = a(31)
-    val signB = b(31)
+    val signA = format.sign(a)
+    val signB = format.sign(b)
 
-    val expA = a(30, 23)
-    val expB = b(30, 23)
+    val expA = format.exponent(a)
+    val expB = format.exponent(b)
 
-    val mantA = a(22, 0)
-    val mantB = b(22, 0)
+    val mantA = format.fraction(a)
+    val mantB = format.fraction(b)
 
     val absALess = (expA < expB) || (expA === expB && mantA <= mantB)
     val absAEqual = (expA === expB && mantA === mantB)
@@ -65,37 +107,80 @@ class BPU extends Module {
     aLessThanB
   }
 
+  // Each field of the records is held in its own bank, with a single write port so that it maps to an SRAM
+  // The reads are asynchronous, so a record is used the same way as a register
+  class BodyBank {
+    val mem = Mem(bodies, UInt(width.W))
+    val wen = WireDefault(false.B)
+    val waddr = WireDefault(io.slot)
+    val wdata = WireDefault(0.U(width.W))
+    val cur = mem.read(io.slot) // Record being updated
+    val out = mem.read(io.out_slot) // Record driven on the outputs
+
+    // Write the record being updated
+    def :=(value: UInt): Unit = {
+      write(io.slot, value)
+    }
+
+    // Write another record, used by the velocity update
+    def write(slot: UInt, value: UInt): Unit = {
+      wen := true.B
+      waddr := slot
+      wdata := value
+    }
+  }
+
   // Internal states
-  val pos_X = RegInit(0.U(32.W))
-  val pos_Y = RegInit(0.U(32.W))
-  val pos_Z = RegInit(0.U(32.W))
+  val pos_X = new BodyBank
+  val pos_Y = new BodyBank
+  val pos_Z = new BodyBank
+
+  val mass = new BodyBank
 
-  val mass = RegInit(0.U(32.W))
+  val size = new BodyBank
 
-  val size = RegInit(0.U(32.W))
+  io.size_out := size.out
 
-  io.size_out := size
+  val velocity_X = new BodyBank
+  val velocity_Y = new BodyBank
+  val velocity_Z = new BodyBank
 
-  val velocity_X = RegInit(0.U(32.W))
-  val velocity_Y = RegInit(0.U(32.W))
-  val velocity_Z = RegInit(0.U(32.W))
+  // Symmetric pairs: sum of the reactions sent back to each record during the velocity update, applied to the
+  // velocity with the position update
+  val reactions = if (symmetric) Seq.fill(3)(new BodyBank) else Seq()
 
+  val banks = Seq(pos_X, pos_Y, pos_Z, mass, size, velocity_X, velocity_Y, velocity_Z) ++ reactions
 
-  val fastNegThreeHalfExp = Module(new NegThreeHalfExp())
-  val mult = Module(new F32Multiplier())
-  val add = Module(new F32Adder())
+  // The banks can't be reset in one cycle, so they are cleared one record per cycle
+  val wiping = RegInit(false.B)
+  val wipe_slot = RegInit(0.U(slot_width.W))
+  io.busy := wiping
 
-  val connectFastExpToMultiplier = RegInit(false.B)
-  val connectFastExpToSubtractor = RegInit(false.B)
+
+  // One multiplier and one fused multiply-add unit per lane, three lanes handle the x, y and z components together
+  // With unitStages, their results come that many cycles later, the schedules wait for them
+  val mults = Seq.fill(lanes)(Module(new FPMultiplier(format, unitStages)))
+  val fmas = Seq.fill(lanes)(Module(new FPFMA(format, unitStages)))
+  // Hardware of the custom nodes, the table seed, shared by the schedules like the units
+  val customs = Dataflow.customUnits()
 
   val collidedReg = RegInit(false.B)
+  val collided_slot = RegInit(0.U(slot_width.W))
+  val collided_source = RegInit(0.U(width.W))
   io.collided := collidedReg
+  io.collided_slot := collided_slot
+  io.collided_source := collided_source
   val counter_wire = WireDefault(0.U(5.W))
   val counter_reg = RegNext(counter_wire) // 0 to 31, used to track the sub state of the BPU
-  val reset_counter = RegNext(io.m_slct) =/= io.m_slct // Reset the counter when m_slct changes
+  // Reset the counter when m_slct changes, or when asked to, as the same operation can be repeated on several records
+  val reset_counter = RegNext(io.m_slct) =/= io.m_slct || io.sync
+  // The velocity update restarts every window, a new broadcast body can then be sent
+  val counter_max = Mux(io.m_slct === 0.U, BPU.lastWindowCycle(lanes, symmetric, io.refinements, tableSeed, format),
+    23.U)
+  require(BPU.positionWindow(lanes, symmetric, unitStages) <= 24, "The position update must fit in the sub states")
   
   // Two variables for the counter to have one that updates instantly; the other is needed to keep track of the state
-  counter_wire := Mux(reset_counter || counter_reg >= 23.U, 0.U, counter_reg + 1.U) // Increment the counter when m_slct is not reset
+  counter_wire := Mux(reset_counter || counter_reg >= counter_max, 0.U, counter_reg + 1.U) // Increment the counter when m_slct is not reset
   
   // To avoid losing the cycle that it takes the counter to change, use a wire counter, which is either equal to the counter_int or 0
 
@@ -106,302 +191,129 @@ class BPU extends Module {
   // if m_slct == 4, then output velocity in X_out, Y_out, Z_out instead of position
   // if m_slct = 5, reset all the registers, including the collision register 
   // if m_slct == 6, then stand by, do nothing
-
-  // Used to store miscellaneous values
-  val temp1 = RegInit(0.U(32.W)) 
-  val temp2 = RegInit(0.U(32.W)) 
-  val temp3 = RegInit(0.U(32.W)) 
-
-  // Used to store the \vec d
-  val tempX = RegInit(2.U(32.W))
-  val tempY = RegInit(0.U(32.W))
-  val tempZ = RegInit(0.U(32.W))
-  
-  add.io.substracter := true.B // Work as a add by default
-
-  // Handling the mult & add modules sharing
-  // counter_wire =/= 0.U because it takes one cycle to update connectFastExpToMultiplier, but we never want to share the mult with the fastExp module at the first cycle
-  when (connectFastExpToMultiplier && counter_wire =/= 0.U) {
-    mult.io.a := fastNegThreeHalfExp.io.mulA
-    mult.io.b := fastNegThreeHalfExp.io.mulB
-  }. otherwise {
-    mult.io.a := 0.U // Default value to avoid uninitialized ref
+  // if m_slct == 8, then set position, mass and size like 2, and velocity to VX_in, VY_in, VZ_in
+  // if m_slct == 9, then clear the collision register if it holds the record
+  // if m_slct == 10, then output the reactions in X_out, Y_out, Z_out instead of position, with symmetric pairs
+  // if m_slct == 11, then set the collision register to the record, collided with the body given in X_in
+  // All of them work on the record selected by slot, and the outputs show the record selected by out_slot
+
+  // Default values to avoid uninitialized refs, the operations below drive the units when they need them
+  for (mult <- mults) {
+    mult.io.a := 0.U
     mult.io.b := 0.U
   }
-  
-  fastNegThreeHalfExp.io.mulOut := mult.io.out
-
-  fastNegThreeHalfExp.io.rst := false.B // Default value to avoid uninitialized ref
-  fastNegThreeHalfExp.io.in := 0.U // Default value to avoid uninitialized ref
-
-  when (connectFastExpToSubtractor && counter_wire =/= 0.U) {
-    add.io.a := fastNegThreeHalfExp.io.subA
-    add.io.b := fastNegThreeHalfExp.io.subB
-  }. otherwise {
-    add.io.a := 0.U // Default value to avoid uninitialized ref
-    add.io.b := 0.U
+  for (fma <- fmas) {
+    fma.io.a := 0.U
+    fma.io.b := 0.U
+    fma.io.c := 0.U
+    fma.io.negate := false.B
   }
-  fastNegThreeHalfExp.io.subOut := add.io.sum
-
-  def updateVelocity(): Unit = {
-
-    // printf("====================================================\n")
-    // printf(p"Update velocity\n")
-    // printf(p"counter_wire: ${binStr(counter_wire, 5)}\n")
-    // printf(p"Temp1: ${binStr(temp1, 32)}\n")
-    // printf(p"Temp2: ${binStr(temp2, 32)}\n")  
-    // printf(p"Temp3: ${binStr(temp3, 32)}\n")
-    // printf(p"TempX: ${binStr(tempX, 32)}\n")
-    // printf(p"TempY: ${binStr(tempY, 32)}\n")
-    // printf(p"TempZ: ${binStr(tempZ, 32)}\n")
-    // printf(p"Velocity X: ${binStr(velocity_X, 32)}\n")
-    // printf(p"Velocity Y: ${binStr(velocity_Y, 32)}\n")
-    // printf(p"Velocity Z: ${binStr(velocity_Z, 32)}\n")
-    // printf("====================================================\n")
-    // printf(p"Update velocity\n")
-
-    switch(counter_wire) {
-
-      is(0.U) {
-    // printf("====================================================\n")
-    //     printf(p"Current positionX: ${binStr(pos_X, 32)}\n")
-    //     printf(p"Current positionY: ${binStr(pos_Y, 32)}\n")
-    //     printf(p"Current positionZ: ${binStr(pos_Z, 32)}\n")
-    //     // printf("Velocity update starting up\n")
-    //     printf(p"Current velocityX: ${binStr(velocity_X, 32)}\n")
-    //     printf(p"Current velocityY: ${binStr(velocity_Y, 32)}\n")
-    //     printf(p"Current velocityZ: ${binStr(velocity_Z, 32)}\n")
-    // printf("====================================================\n")
-
-        // printf(p"Collision register state: $collidedReg")
-        connectFastExpToMultiplier := false.B
-        connectFastExpToSubtractor := false.B
-
-        // Start computing m1 * m2, and \vec d
-        // mult.io.a := mass
-        // mult.io.b := io.m_in
-        // temp1 := mult.io.out // Store m1 * m2 in temp1
-        temp1 := io.m_in // Because we want the acceleration, not the force, will have to clean up later, I can probably remove one of the temps
 
-        add.io.a := io.X_in
-        add.io.b := pos_X
-        tempX := add.io.sum
-      }
-
-      is(1.U) {
-        // Compute \vec d
-        add.io.a := io.Y_in
-        add.io.b := pos_Y
-        tempY := add.io.sum
-        // printf(p"dy: ${binStr(add.io.sum, 32)}\n")
-
-        // Start computing ||d||^2
-        mult.io.a := tempX
-        mult.io.b := tempX
-        // printf(p"dX^2: ${binStr(mult.io.out, 32)}\n")
-        temp2 := mult.io.out // Store d_x^2 in temp2
-      }
-
-      is(2.U) {
-        // Compute \vec d
-        add.io.a := io.Z_in
-        add.io.b := pos_Z
-        tempZ := add.io.sum
-        // Start computing ||d||^2
-        mult.io.a := tempY
-        mult.io.b := tempY
-        // printf(p"dY^2: ${binStr(mult.io.out, 32)}\n")
-        temp3 := mult.io.out // Store d_y^2 in temp3
-      }
-
-      is(3.U) {
-        // Compute ||d||^2
-        mult.io.a := tempZ
-        mult.io.b := tempZ
-        temp2 := mult.io.out // Store d_z^2 in temp2
-
-        // Compute d_x^2 + d_y^2 
-        add.io.substracter := false.B
-        add.io.a := temp2
-        add.io.b := temp3
-        temp3 := add.io.sum // Store d_x^2 + d_y^2 in temp3
-        // printf(p"dZ^2: ${binStr(mult.io.out, 32)}\n")	
-        // printf(p"dx^2 + dy^2: ${binStr(add.io.sum, 32)}\n")
-        connectFastExpToMultiplier := true.B // The exp will start at the next cycle, at it needs the multiplier from the start
-      }
-
-      is (4.U) {
-        // Compute ||d||^2
-        add.io.substracter := false.B
-        add.io.a := temp2
-        add.io.b := temp3
-        temp2 := add.io.sum // Store ||d||^2 in temp2
-        // printf(p"dx^2 + dy^2 + dz^2: ${binStr(add.io.sum, 32)}\n")
-        fastNegThreeHalfExp.io.in := add.io.sum
-        fastNegThreeHalfExp.io.rst := true.B // Reset the fastExp module
-      }
-
-      is (5.U) {
-        add.io.substracter := false.B 
-        add.io.a := size
-        add.io.b := io.size_in
-        temp3 := add.io.sum // Store size + size_in in temp3
-        fastNegThreeHalfExp.io.in := temp2
-        // printf(p"Input of fastExp: ${binStr(fastNegThreeHalfExp.io.in, 32)}\n")
-        fastNegThreeHalfExp.io.rst := false.B 
-        connectFastExpToSubtractor := true.B
-      }
-      is (6.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (7.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        connectFastExpToMultiplier := false.B // Shouldn't be needed at the next cycle
-      }
-      is (8.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        // Multiply m2 by dt
-        mult.io.a := io.dt // dt
-        mult.io.b := temp1 // m2 * dt
-        temp1 := mult.io.out // Storem2 * dt in temp1
-        connectFastExpToMultiplier := true.B
-      }
-      is (9.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (10.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (11.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        connectFastExpToMultiplier := false.B
-      }
-      is (12.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        mult.io.a := temp3 // size1 + size2
-        mult.io.b := temp3
-        temp3 := mult.io.out // Store (size1 + size2)^2 in temp3, to compare with the distance^2
-        connectFastExpToMultiplier := true.B
-      }
-      is (13.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        // Compare temp3, which is (size1 + size2)^2, with temp2 (||d||^2 )
-        collidedReg := Mux(compareFloats(temp2, temp3), true.B, collidedReg) 
-      }
-      is (14.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (15.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (16.U) {
-        fastNegThreeHalfExp.io.in := temp2
-      }
-      is (17.U) {
-        fastNegThreeHalfExp.io.in := temp2
-        temp3 := fastNegThreeHalfExp.io.out
-        connectFastExpToSubtractor := false.B
-        connectFastExpToMultiplier := false.B
-      }
-      is (18.U) {
-        mult.io.a := temp1 // m2 * dt
-        mult.io.b := temp3 // 1 / (d^3)
-        // printf(p" m1*m2 : ${binStr(temp1, 32)}\n")
-        // printf(p" 1/(d^3): ${binStr(temp3, 32)}\n")
-        temp2 := mult.io.out
-      }
-      is (19.U) {
-        // It is possible to connect the output of the multiplier to the input of the adder, 
-        // but 
-        // 1 : It would likely force to slow down a clk cycle
-        // 2 : it creates a combinartorial loop inside the three half exp module, which would force some corner cases to be handled
-        mult.io.a := tempX // d_x
-        mult.io.b := temp2 // dt*m2/(d^3)
-        // printf(p" m1*m2/(d^3): ${binStr(temp2, 32)}\n")
-        // printf(p" dx: ${binStr(tempX, 32)}\n")
-        temp3 := mult.io.out
-      }
-      is (20.U) {
-        add.io.substracter := false.B
-        add.io.a := temp3
-        add.io.b := velocity_X
-        velocity_X := add.io.sum // Update the x velocity   
-        // printf(p"Delta velocityX: ${binStr(temp3, 32)}\n")
-
-        mult.io.a := tempY // d_y
-        mult.io.b := temp2 // dt*m2/(d^3)
-        temp3 := mult.io.out
+  def updatePosition(): Unit = {
+    // position += dt * velocity on the fused multiply-add units, the axes are spread over the lanes,
+    // one cycle per axis with a single lane and all three in the same cycle with three lanes
+    // With symmetric pairs, the reactions are first subtracted from the velocity, and cleared for the next iteration
+    // The results are written unitStages cycles after the units start
+    val steps = BPU.positionWindow(lanes, unitStages = unitStages)
+    val axes = Seq((pos_X, velocity_X), (pos_Y, velocity_Y), (pos_Z, velocity_Z))
+    for (((pos, velocity), i) <- axes.zipWithIndex) {
+      val fma = fmas(i % lanes)
+      if (symmetric) {
+        when (counter_wire === (i / lanes).U) {
+          fma.io.a := reactions(i).cur
+          fma.io.b := format.one
+          fma.io.c := velocity.cur
+          fma.io.negate := true.B
+          reactions(i) := 0.U
+        }
+        when (counter_wire === (i / lanes + unitStages).U) {
+          velocity := fma.io.out
+        }
       }
-      is (21.U) {     
-        add.io.substracter := false.B
-        add.io.a := temp3
-        add.io.b := velocity_Y
-        velocity_Y := add.io.sum 
-
-        
-        mult.io.a := tempZ // d_z
-        mult.io.b := temp2 // m1*m2/(d^3)
-        temp3 := mult.io.out
+      val start = (if (symmetric) steps else 0) + i / lanes
+      when (counter_wire === start.U) {
+        fma.io.a := io.dt
+        fma.io.b := velocity.cur
+        fma.io.c := pos.cur
       }
-      is (22.U) {        
-        add.io.substracter := false.B
-        add.io.a := temp3
-        add.io.b := velocity_Z
-        velocity_Z := add.io.sum // Update the z velocity  
-        // printf("Velocity update finished\n")
-        // printf(p"New velocityX: ${binStr(velocity_X, 32)}\n")
-        // printf(p"New velocityY: ${binStr(velocity_Y, 32)}\n")
-        // printf(p"New velocityZ: ${binStr(velocity_Z, 32)}\n")
+      when (counter_wire === (start + unitStages).U) {
+        pos := fma.io.out
       }
-      
-      // is (23.U) { }       
+    }
+  }
 
+  // The velocity update is generated from BPU.velocityUpdate, either on the shared multipliers and fused multiply-add
+  // units, where a new broadcast body is accepted every window while the previous ones finish,
+  // or in the pipelined variant on its own units, where a new broadcast body is accepted every cycle
+  // The record updated may not be the one selected by slot anymore when the operation ends
+  def record(a: UInt): UInt = a(slot_width - 1, 0)
+  def checkCollision(a: Seq[UInt]): Unit = {
+    // Compare ||d||^2 with (size1 + size2)^2
+    when (compareFloats(a(0), a(1)) && !collidedReg) {
+      collidedReg := true.B
+      collided_slot := record(a(2))
+      collided_source := a(3)
     }
   }
+  val velocity_inputs = Map(
+    "X_in" -> io.X_in, "Y_in" -> io.Y_in, "Z_in" -> io.Z_in,
+    "m_in" -> io.m_in, "size_in" -> io.size_in, "dt" -> io.dt,
+    "pos_X" -> pos_X.cur, "pos_Y" -> pos_Y.cur, "pos_Z" -> pos_Z.cur,
+    "size" -> size.cur, "mass" -> mass.cur, "slot" -> io.slot, "source" -> io.source, "refinements" -> io.refinements)
+  val velocity_loads = Map(
+    "velocity_X" -> ((a: Seq[UInt]) => velocity_X.mem.read(record(a(0)))),
+    "velocity_Y" -> ((a: Seq[UInt]) => velocity_Y.mem.read(record(a(0)))),
+    "velocity_Z" -> ((a: Seq[UInt]) => velocity_Z.mem.read(record(a(0)))))
+  val velocity_stores = Map(
+    "collision" -> (checkCollision _),
+    "store_velocity_X" -> ((a: Seq[UInt]) => velocity_X.write(record(a(1)), a(0))),
+    "store_velocity_Y" -> ((a: Seq[UInt]) => velocity_Y.write(record(a(1)), a(0))),
+    "store_velocity_Z" -> ((a: Seq[UInt]) => velocity_Z.write(record(a(1)), a(0))),
+    "reaction" -> ((a: Seq[UInt]) => {
+      io.reaction_valid := true.B
+      io.reaction_X := a(0)
+      io.reaction_Y := a(1)
+      io.reaction_Z := a(2)
+    }))
+  io.reaction_valid := false.B
+  io.reaction_X := 0.U
+  io.reaction_Y := 0.U
+  io.reaction_Z := 0.U
+  if (pipelined) {
+    val velocity = new PipelinedOperation(BPU.velocityPipeline(symmetric, tableSeed, unitStages, format),
+      valid = io.m_slct === 0.U,
+      inputs = velocity_inputs, loads = velocity_loads, stores = velocity_stores)
+    io.pipeline_busy := velocity.busy
+  } else {
+    // One schedule per number of refinement passes, sharing the units. Only the selected one is issued, and the
+    // number of passes only changes between simulations, so they never run at the same time
+    val velocity = for (passes <- BPU.refinementPasses(format)) yield {
+      new ScheduledOperation(BPU.velocitySchedule(lanes, symmetric, passes, tableSeed, unitStages, format), mults, fmas,
+        issue = io.m_slct === 0.U && counter_wire === 0.U && io.refinements === passes.U,
+        flush = io.m_slct === 5.U,
+        inputs = velocity_inputs, loads = velocity_loads, stores = velocity_stores, customUnits = customs)
+    }
+    io.pipeline_busy := velocity.map(_.busy).reduce(_ || _)
+  }
 
-  def updatePosition(): Unit = {
-    switch (counter_wire) {
-      is(0.U) {
-        // In case it was interrupted during another operation
-        connectFastExpToMultiplier := false.B
-        connectFastExpToSubtractor := false.B 
-        
-        mult.io.a := io.dt
-        mult.io.b := velocity_X
-        temp1 := mult.io.out
-      }
-      is(1.U) {
-        mult.io.a := io.dt
-        mult.io.b := velocity_Y
-        temp1 := mult.io.out
-
-        add.io.substracter := false.B
-        add.io.a := temp1 // dt * velocityX
-        add.io.b := pos_X
-        pos_X := add.io.sum
-      }
-      is(2.U) {
-        mult.io.a := io.dt
-        mult.io.b := velocity_Z
-        temp1 := mult.io.out
-
-        add.io.substracter := false.B
-        add.io.a := temp1 // dt * velocityX
-        add.io.b := pos_Y
-        pos_Y := add.io.sum
-      }
-      is(3.U) {
-        add.io.substracter := false.B
-        add.io.a := temp1 // dt * velocityX
-        add.io.b := pos_Z
-        pos_Z := add.io.sum
+  // Reactions sent back to one of the records, by the bodies it was broadcast to
+  if (symmetric) {
+    val reaction_in = Seq(io.reaction_in_X, io.reaction_in_Y, io.reaction_in_Z)
+    for ((bank, in) <- reactions.zip(reaction_in)) {
+      val adder = Module(new FPFMA(format))
+      adder.io.a := in
+      adder.io.b := format.one
+      adder.io.c := bank.mem.read(io.reaction_slot)
+      adder.io.negate := false.B
+      when (io.reaction_in_valid) {
+        bank.write(io.reaction_slot, adder.io.out)
       }
     }
   }
 
   switch(io.m_slct) {
     is(0.U) { 
-      updateVelocity()
+      // Update velocity, handled above by the pipeline or the scheduled operation
     }
     is(1.U) { // Update position
       updatePosition() 
@@ -431,7 +343,9 @@ class BPU extends Module {
       mass  := io.m_in
       size  := io.size_in
       // Reset collision register
-      collidedReg := false.B
+      when (collided_slot === io.slot) {
+        collidedReg := false.B
+      }
     }
     is(3.U) { // Set velocity
       velocity_X := io.X_in
@@ -442,37 +356,233 @@ class BPU extends Module {
       // Already handled in the output section
     }
     is(5.U) { 
-      // Reset all registers
+      // Reset all registers, the banks are cleared in the next cycles
       collidedReg := false.B
-      pos_X := 0.U
-      pos_Y := 0.U 
-      pos_Z := 0.U
-      mass := 0.U
-      size := 0.U
-      velocity_X := 0.U
-      velocity_Y := 0.U
-      velocity_Z := 0.U
+      collided_slot := 0.U
+      wiping := true.B
+      wipe_slot := 0.U
     }
     is (6.U) {
       // Do nothing
     }
+    is (8.U) { // Load the full body at once
+      pos_X := io.X_in
+      pos_Y := io.Y_in
+      pos_Z := io.Z_in
+      mass  := io.m_in
+      size  := io.size_in
+      velocity_X := io.VX_in
+      velocity_Y := io.VY_in
+      velocity_Z := io.VZ_in
+      // The body doesn't have any reaction to apply yet
+      for (reaction <- reactions) {
+        reaction := 0.U
+      }
+      when (collided_slot === io.slot) {
+        collidedReg := false.B
+      }
+    }
+    is (9.U) { // Clear the collision register, when the collision is the one of the record
+      when (collided_slot === io.slot) {
+        collidedReg := false.B
+      }
+    }
+    is (11.U) { // Set the collision register, when restoring a checkpoint
+      collidedReg := true.B
+      collided_slot := io.slot
+      collided_source := io.X_in
+    }
+  }
+
+  // Write back, a record written by the operation above has priority over the one being cleared
+  val bank_written = banks.map(_.wen).reduce(_ || _)
+  for (bank <- banks) {
+    when (bank.wen || wiping) {
+      bank.mem.write(Mux(bank.wen, bank.waddr, wipe_slot), Mux(bank.wen, bank.wdata, 0.U))
+    }
+  }
+  when (wiping && !bank_written) {
+    wipe_slot := wipe_slot + 1.U
+    when (wipe_slot === (bodies - 1).U) {
+      wiping := false.B
+    }
   }
 
   when(io.m_slct === 4.U) {
     // Output velocity instead of position
-    io.X_out := velocity_X
-    io.Y_out := velocity_Y
-    io.Z_out := velocity_Z
+    io.X_out := velocity_X.out
+    io.Y_out := velocity_Y.out
+    io.Z_out := velocity_Z.out
   }.otherwise {
     // Output position and mass
-    io.X_out := pos_X
-    io.Y_out := pos_Y
-    io.Z_out := pos_Z
+    io.X_out := pos_X.out
+    io.Y_out := pos_Y.out
+    io.Z_out := pos_Z.out
+  }
+  if (symmetric) {
+    when (io.m_slct === 10.U) {
+      // Reactions not applied to the velocity yet
+      io.X_out := reactions(0).out
+      io.Y_out := reactions(1).out
+      io.Z_out := reactions(2).out
+    }
   }
 
   // Output mass
-  io.m_out := mass
+  io.m_out := mass.out
+
+
+
+}
+
+object BPU {
+  // Newton-Raphson passes of the ||d||^-3 computation, selected at runtime. The third pass already reaches the
+  // precision of the floats, fewer passes give shorter velocity update windows
+  val maxRefinements = FloatFormat.F32.refinements
+  // Double precision needs a fourth pass, see FloatFormat.refinements
+  def maxRefinementsFor(format: FloatFormat): Int = format.refinements
+  def refinementPasses(format: FloatFormat = FloatFormat.F32) = 0 to maxRefinementsFor(format)
+  def refinementsWidth(format: FloatFormat = FloatFormat.F32): Int = log2Ceil(maxRefinementsFor(format) + 1)
+  // The table seed is already as precise as three passes
+  def defaultRefinements(tableSeed: Boolean, format: FloatFormat = FloatFormat.F32): Int =
+    if (tableSeed) 0 else maxRefinementsFor(format)
+
+  // Velocity update of a record by a broadcast body
+  // With symmetric set, the reaction of the record on the broadcast body is computed as well, so that each pair is
+  // only computed once
+  // With selectable set, the refinements input skips the last passes instead, for the pipeline, which can't change
+  // its length
+  // With tableSeed set, the passes start from NegThreeHalfExpTable instead of the magic constant approximation
+  // All the values are floats of the given format
+  def velocityUpdate(symmetric: Boolean = false, refinements: Int = maxRefinements, selectable: Boolean = false,
+                     tableSeed: Boolean = false, format: FloatFormat = FloatFormat.F32): Dataflow = {
+    val flow = new Dataflow(format)
+    // Broadcast body, record being updated and its slot, and the index of the broadcast body
+    for (name <- Seq("X_in", "Y_in", "Z_in", "m_in", "size_in", "dt", "pos_X", "pos_Y", "pos_Z", "size", "slot", "source")) {
+      flow.input(name)
+    }
+    if (symmetric) {
+      flow.input("mass")
+    }
+    if (selectable) {
+      flow.input("refinements")
+    }
+
+    // Compute \vec d and ||d||^2, the squares of d_x and d_z are fused with the sums
+    flow.sub("dX", "X_in", "pos_X")
+    flow.sub("dY", "Y_in", "pos_Y")
+    flow.sub("dZ", "Z_in", "pos_Z")
+    flow.mul("dY_sq", "dY", "dY")
+    flow.fma("sum_xy", "dX", "dX", "dY_sq")
+    flow.fma("dist_sq", "dZ", "dZ", "sum_xy")
+
+    // ||d||^-3, same steps as NegThreeHalfExp: x^3, the initial approximation, and up to format.refinements
+    // Newton-Raphson refinements y * (1.5 - x^3 * y^2 / 2), where 1.5 - (x^3 * y / 2) * y is a single fused multiply-add
+    if (refinements > 0) {
+      flow.mul("x_sq", "dist_sq", "dist_sq")
+      flow.mul("x_cube", "x_sq", "dist_sq")
+    }
+    if (tableSeed) {
+      flow.custom("approx0", NegThreeHalfExpTable.latency, "dist_sq") { a =>
+        val table = Module(new NegThreeHalfExpTable())
+        table.io.in := a(0)
+        table.io.out
+      }
+    } else {
+      flow.logic("approx0", "dist_sq") { a =>
+        val initial = Module(new NegThreeHalfExpInitial(format))
+        initial.io.in := a(0)
+        initial.io.out
+      }
+    }
+    flow.logic("one_point_five")(_ => format.onePointFive)
+    for (i <- 1 to refinements) {
+      val approx = s"approx${i - 1}"
+      val refined = if (selectable) s"refined$i" else s"approx$i"
+      flow.mul(s"refine${i}_a", approx, "x_cube")
+      flow.logic(s"refine${i}_half", s"refine${i}_a") { a =>
+        Cat(0.U(1.W), format.exponent(a(0)) - 1.U, format.fraction(a(0))) // divide by 2
+      }
+      flow.fma(s"refine${i}_c", s"refine${i}_half", approx, "one_point_five", negate = true)
+      flow.mul(s"refine${i}_d", approx, s"refine${i}_c")
+      flow.logic(refined, s"refine${i}_d") { a => Cat(0.U(1.W), a(0)(format.width - 2, 0)) }
+      if (selectable) {
+        flow.logic(s"approx$i", refined, approx, "refinements") { a => Mux(a(2) >= i.U, a(0), a(1)) }
+      }
+    }
+    flow.logic("inv_cube", s"approx$refinements", "dist_sq") { a =>
+      val exponent = format.exponent(a(1))
+      val fraction = format.fraction(a(1))
+      val isZero = (exponent === 0.U) && (fraction === 0.U)
+      val isInf = (exponent === format.maxExp.U) && (fraction === 0.U)
+      val isNaN = (exponent === format.maxExp.U) && (fraction =/= 0.U)
+      val isNegative = format.sign(a(1)) && !isZero
+      MuxCase(a(0), Seq(
+        (isNegative || isNaN) -> format.nan,
+        isZero -> format.inf(false.B),
+        isInf -> 0.U(format.width.W)))
+    }
 
+    // Collision detection
+    flow.add("size_sum", "size", "size_in")
+    flow.mul("size_sq", "size_sum", "size_sum")
+    flow.store("collision", "dist_sq", "size_sq", "slot", "source")
+
+    // m2 * dt / ||d||^3, then accumulate into the velocity
+    if (symmetric) {
+      // dt / ||d||^3 is shared by both bodies of the pair
+      flow.mul("dt_inv_cube", "dt", "inv_cube")
+      flow.mul("factor", "dt_inv_cube", "m_in")
+      flow.mul("factor_self", "dt_inv_cube", "mass")
+    } else {
+      flow.mul("mdt", "dt", "m_in")
+      flow.mul("factor", "mdt", "inv_cube")
+    }
+    for (axis <- Seq("X", "Y", "Z")) {
+      flow.load(s"velocity_$axis", "slot")
+      flow.fma(s"new_velocity_$axis", s"d$axis", "factor", s"velocity_$axis")
+      flow.store(s"store_velocity_$axis", s"new_velocity_$axis", "slot")
+    }
 
+    // Reaction m1 * dt / ||d||^3 * \vec d, subtracted from the broadcast body's velocity
+    if (symmetric) {
+      for (axis <- Seq("X", "Y", "Z")) {
+        flow.mul(s"reaction_$axis", s"d$axis", "factor_self")
+      }
+      flow.store("reaction", "reaction_X", "reaction_Y", "reaction_Z")
+    }
+    flow
+  }
 
+  // unitStages is the number of register stages of the units, see F32Multiplier and F32FMA
+  def velocitySchedule(lanes: Int, symmetric: Boolean = false, refinements: Int = maxRefinements,
+                       tableSeed: Boolean = false, unitStages: Int = 0,
+                       format: FloatFormat = FloatFormat.F32): Schedule =
+    velocityUpdate(symmetric, refinements, tableSeed = tableSeed, format = format).schedule(lanes, unitStages)
+  def velocityPipeline(symmetric: Boolean = false, tableSeed: Boolean = false, unitStages: Int = 0,
+                       format: FloatFormat = FloatFormat.F32): Schedule =
+    velocityUpdate(symmetric, maxRefinementsFor(format), selectable = true, tableSeed = tableSeed,
+      format = format).pipeline(unitStages)
+  // Cycles between two broadcast bodies, the pipelined units don't change it
+  def velocityWindow(lanes: Int, symmetric: Boolean = false, refinements: Int = maxRefinements,
+                     tableSeed: Boolean = false, format: FloatFormat = FloatFormat.F32): Int =
+    velocitySchedule(lanes, symmetric, refinements, tableSeed, format = format).II
+  // Last cycle of the window, for the number of passes selected at runtime
+  def lastWindowCycle(lanes: Int, symmetric: Boolean, refinements: UInt, tableSeed: Boolean = false,
+                      format: FloatFormat = FloatFormat.F32): UInt =
+    VecInit(refinementPasses(format).map(passes =>
+      (velocityWindow(lanes, symmetric, passes, tableSeed, format) - 1).U(5.W)))(refinements)
+  // Cycles from the start of a velocity update to the sum of its reactions over the bpus BPUs, with symmetric pairs
+  def reactionLatency(pipelined: Boolean, lanes: Int, refinements: Int = maxRefinements, tableSeed: Boolean = false,
+                      unitStages: Int = 0, format: FloatFormat = FloatFormat.F32, bpus: Int = 1): Int = {
+    val sched = if (pipelined) velocityPipeline(true, tableSeed, unitStages, format)
+      else velocitySchedule(lanes, true, refinements, tableSeed, unitStages, format)
+    sched.start("reaction") + reactionSumLatency(bpus, unitStages)
+  }
+  // The reactions are summed by a tree of adders, one registered level per halving
+  def reactionSumLatency(bpus: Int, unitStages: Int = 0): Int = log2Ceil(bpus) * (unitStages + 1)
+  // Cycles to update the position of a record, twice as many with symmetric pairs to apply the reactions first.
+  // The last results come unitStages cycles after the units start
+  def positionWindow(lanes: Int, symmetric: Boolean = false, unitStages: Int = 0): Int =
+    ((3 + lanes - 1) / lanes + unitStages) * (if (symmetric) 2 else 1)
 }
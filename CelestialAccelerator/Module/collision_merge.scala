@@ -0,0 +1,111 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+
+// Merge of two bodies that collided into one, on a multiplier and a fused multiply-add unit: the masses and the
+// momenta are added, the position is the centre of mass, and the sizes are added by volume
+// With symmetric pairs, the velocities are given with the reactions that are still to be applied, which are
+// subtracted first. The merged record is given once busy goes low, and held until the next merge
+class CollisionMerge(val symmetric: Boolean = false, val unitStages: Int = 0,
+                     val format: FloatFormat = FloatFormat.F32) extends Module {
+  val width = format.width
+  val fields = CollisionMerge.fields(symmetric)
+
+  val io = IO(new Bundle {
+    val start = Input(Bool()) // The records are only used at this cycle
+    // X, Y, Z, dX, dY, dZ, mass, size (same order as the C struct), then the reactions with symmetric pairs
+    val a = Input(Vec(fields.length, UInt(width.W)))
+    val b = Input(Vec(fields.length, UInt(width.W)))
+    val busy = Output(Bool())
+    val merged = Output(Vec(8, UInt(width.W))) // X, Y, Z, dX, dY, dZ, mass, size
+  })
+
+  val mult = Module(new FPMultiplier(format, unitStages))
+  val fma = Module(new FPFMA(format, unitStages))
+  mult.io.a := 0.U
+  mult.io.b := 0.U
+  fma.io.a := 0.U
+  fma.io.b := 0.U
+  fma.io.c := 0.U
+  fma.io.negate := false.B
+
+  val merged = Reg(Vec(8, UInt(width.W)))
+  io.merged := merged
+
+  val inputs = (for ((body, record) <- Seq("a" -> io.a, "b" -> io.b); (field, i) <- fields.zipWithIndex)
+    yield s"${field}_$body" -> record(i)).toMap
+  val merge = new ScheduledOperation(CollisionMerge.mergeUpdate(symmetric, format).schedule(1, unitStages),
+    Seq(mult), Seq(fma), issue = io.start, flush = false.B,
+    inputs = inputs, loads = Map(), stores = Map("merged" -> ((a: Seq[UInt]) => merged := VecInit(a))))
+  io.busy := merge.busy
+}
+
+object CollisionMerge {
+  // Values of a body given to the merge
+  def fields(symmetric: Boolean): Seq[String] =
+    Seq("X", "Y", "Z", "dX", "dY", "dZ", "mass", "size") ++ (if (symmetric) Seq("rX", "rY", "rZ") else Seq())
+
+  def mergeUpdate(symmetric: Boolean = false, format: FloatFormat = FloatFormat.F32): Dataflow = {
+    val flow = new Dataflow(format)
+    for (body <- Seq("a", "b"); field <- fields(symmetric)) {
+      flow.input(s"${field}_$body")
+    }
+    def isZero(x: UInt): Bool = format.exponent(x) === 0.U
+    flow.logic("one")(_ => format.one)
+    flow.logic("half")(_ => (BigInt(format.bias - 1) << format.fracWidth).U(format.width.W))
+    flow.logic("third")(_ => ((BigInt(format.bias - 2) << format.fracWidth) | ((BigInt(1) << format.fracWidth) / 3)).U(format.width.W))
+
+    // 1 / (m_a + m_b), from the initial approximation and Newton-Raphson passes r * (2 - m * r), where 1 - m * r and
+    // r + r * (1 - m * r) are both fused multiply-adds
+    flow.add("merged_mass", "mass_a", "mass_b")
+    flow.logic("inv_mass0", "merged_mass") { a => format.reciprocalMagic.U(format.width.W) - a(0) }
+    for (i <- 1 to format.refinements) {
+      flow.fma(s"inv_mass${i}_e", "merged_mass", s"inv_mass${i - 1}", "one", negate = true)
+      flow.fma(s"inv_mass$i", s"inv_mass${i - 1}", s"inv_mass${i}_e", s"inv_mass${i - 1}")
+    }
+    // Share of each body, two bodies without mass count as much
+    for (body <- Seq("a", "b")) {
+      flow.mul(s"share_${body}_raw", s"mass_$body", s"inv_mass${format.refinements}")
+      flow.logic(s"share_$body", s"share_${body}_raw", "merged_mass", "half") { a => Mux(isZero(a(1)), a(2), a(0)) }
+    }
+
+    // Centre of mass and velocity of the centre of mass, which keeps the momentum
+    for (axis <- Seq("X", "Y", "Z")) {
+      flow.mul(s"${axis}_part", s"${axis}_a", "share_a")
+      flow.fma(s"merged_$axis", s"${axis}_b", "share_b", s"${axis}_part")
+      val velocities = if (symmetric) {
+        for (body <- Seq("a", "b")) {
+          flow.sub(s"velocity_${axis}_$body", s"d${axis}_$body", s"r${axis}_$body")
+        }
+        Seq(s"velocity_${axis}_a", s"velocity_${axis}_b")
+      } else {
+        Seq(s"d${axis}_a", s"d${axis}_b")
+      }
+      flow.mul(s"d${axis}_part", velocities(0), "share_a")
+      flow.fma(s"merged_d$axis", velocities(1), "share_b", s"d${axis}_part")
+    }
+
+    // Size of the sum of the volumes, V * y^2 with y = V^(-1/3) from the initial approximation and the passes
+    // y + y * (1 - V * y^3) / 3
+    flow.mul("size_a_sq", "size_a", "size_a")
+    flow.mul("size_a_cube", "size_a_sq", "size_a")
+    flow.mul("size_b_sq", "size_b", "size_b")
+    flow.fma("volume", "size_b_sq", "size_b", "size_a_cube")
+    flow.logic("cbrt0", "volume") { a => format.invCubeRootMagic.U(format.width.W) - a(0) / 3.U }
+    for (i <- 1 to format.refinements) {
+      val y = s"cbrt${i - 1}"
+      flow.mul(s"cbrt${i}_sq", y, y)
+      flow.mul(s"cbrt${i}_cube", s"cbrt${i}_sq", y)
+      flow.fma(s"cbrt${i}_e", "volume", s"cbrt${i}_cube", "one", negate = true)
+      flow.mul(s"cbrt${i}_t", y, s"cbrt${i}_e")
+      flow.fma(s"cbrt$i", s"cbrt${i}_t", "third", y)
+    }
+    flow.mul("cbrt_sq", s"cbrt${format.refinements}", s"cbrt${format.refinements}")
+    flow.mul("merged_size_raw", "volume", "cbrt_sq")
+    flow.logic("merged_size", "merged_size_raw", "volume") { a => Mux(isZero(a(1)), 0.U, a(0)) }
+
+    flow.store("merged", Seq("X", "Y", "Z", "dX", "dY", "dZ", "mass", "size").map(field => s"merged_$field"): _*)
+    flow
+  }
+}
@@ -0,0 +1,390 @@
+package celestial
+
+import chisel3._
+import chisel3.util._
+import scala.collection.mutable
+
+object Dataflow {
+  sealed trait Node {
+    val name: String
+    val args: Seq[String]
+  }
+  // Value given by the module when an operation starts
+  case class Input(name: String) extends Node { val args = Seq[String]() }
+  // One cycle on the multiplier, or on the fused multiply-add unit for the other two. With pipelined units, the
+  // result comes unitStages cycles later, while the unit already takes the next operation
+  case class Mul(name: String, args: Seq[String]) extends Node
+  case class Add(name: String, args: Seq[String], substract: Boolean) extends Node
+  case class Fma(name: String, args: Seq[String], negate: Boolean) extends Node
+  // Combinational logic, computed where the value is used
+  case class Logic(name: String, args: Seq[String], f: Seq[UInt] => UInt) extends Node
+  // Operation on its own hardware, built by f for each node, e.g. a lookup table. Its result is registered like the
+  // units' one, latency cycles after it starts, but it isn't shared within a schedule, so it is placed as soon as its
+  // arguments are ready
+  case class Custom(name: String, args: Seq[String], latency: Int, f: Seq[UInt] => UInt) extends Node
+  // Read and write of the module's state, e.g. a memory, given by the module
+  case class Load(name: String, args: Seq[String]) extends Node
+  case class Store(name: String, args: Seq[String]) extends Node
+
+  def isUnit(node: Node): Boolean = node match {
+    case _: Mul | _: Add | _: Fma => true
+    case _ => false
+  }
+
+  // Hardware of the custom nodes by name: its inputs and its output
+  type CustomUnits = mutable.Map[String, (Seq[UInt], UInt)]
+  def customUnits(): CustomUnits = mutable.Map[String, (Seq[UInt], UInt)]()
+}
+
+// Description of an operation done with multipliers and fused multiply-add units, e.g. the velocity update of the BPU
+// Each node can only use the nodes listed before it. All the values are floats of the given format
+class Dataflow(val format: FloatFormat = FloatFormat.F32) {
+  import Dataflow._
+
+  val nodes = mutable.ArrayBuffer[Node]()
+
+  private def append(node: Node): Unit = {
+    require(!nodes.exists(_.name == node.name), s"${node.name} is defined twice")
+    for (arg <- node.args) {
+      require(nodes.exists(_.name == arg), s"${node.name} uses $arg before it is defined")
+    }
+    nodes += node
+  }
+
+  def node(name: String): Node = nodes.find(_.name == name).get
+
+  def input(name: String): Unit = append(Input(name))
+  def mul(name: String, a: String, b: String): Unit = append(Mul(name, Seq(a, b)))
+  def add(name: String, a: String, b: String): Unit = append(Add(name, Seq(a, b), false))
+  def sub(name: String, a: String, b: String): Unit = append(Add(name, Seq(a, b), true)) // a - b
+  def fma(name: String, a: String, b: String, c: String, negate: Boolean = false): Unit = append(Fma(name, Seq(a, b, c), negate)) // c +/- a * b
+  def logic(name: String, args: String*)(f: Seq[UInt] => UInt): Unit = append(Logic(name, args, f))
+  def custom(name: String, latency: Int, args: String*)(f: Seq[UInt] => UInt): Unit = append(Custom(name, args, latency, f))
+  def load(name: String, args: String*): Unit = append(Load(name, args))
+  def store(name: String, args: String*): Unit = append(Store(name, args))
+
+  // First cycle at which a value can be used, relative to the start of the operation
+  def ready(name: String, start: collection.Map[String, Int], unitStages: Int = 0): Int = node(name) match {
+    case _: Input => 0 // Directly from the module's inputs at the first cycle
+    case n @ (_: Logic | _: Load) => (n.args.map(ready(_, start, unitStages)) :+ 0).max
+    case n: Custom => start(name) + n.latency
+    case _ => start(name) + unitStages + 1
+  }
+
+  // Place the nodes in order, at the first cycle given by slot.
+  // A store takes the output of the units directly, so that the value is written at the same cycle and the
+  // next operation can already load it at the next cycle.
+  private def place(II: Int, unitStages: Int, lane: collection.Map[String, Int] = Map())
+                   (slot: (Node, Int) => Int): Schedule = {
+    val start = mutable.Map[String, Int]()
+    def ready(name: String): Int = this.ready(name, start, unitStages)
+    for (n <- nodes) {
+      n match {
+        case _: Mul | _: Add | _: Fma =>
+          start(n.name) = slot(n, (n.args.map(ready) :+ 0).max)
+        case _: Custom =>
+          start(n.name) = (n.args.map(ready) :+ 0).max
+        case _: Store =>
+          start(n.name) = (n.args.map(arg => if (isUnit(node(arg))) start(arg) + unitStages else ready(arg)) :+ 0).max
+        case _ =>
+      }
+    }
+    new Schedule(this, II, start.toMap, lane.toMap, unitStages)
+  }
+
+  // Modulo scheduling on lanes multipliers and as many fused multiply-add units: a new operation starts every
+  // II cycles, while the previous ones are still running. II is the number of uses of the busiest kind of unit
+  // divided by the number of lanes, and each node is placed at the first cycle where its arguments are ready and
+  // one of its units is free in the window of II cycles, which is always found.
+  // Pipelined units are only busy at the cycle an operation starts, so unitStages lengthens the schedule, not II.
+  def schedule(lanes: Int = 1, unitStages: Int = 0): Schedule = {
+    def uses(mul: Boolean): Int = nodes.count(n => isUnit(n) && n.isInstanceOf[Mul] == mul)
+    val II = Seq((uses(true) + lanes - 1) / lanes, (uses(false) + lanes - 1) / lanes, 1).max
+    val used = mutable.Set[(Boolean, Int, Int)]() // Multiplier or not, cycle in the window, lane
+    val lane = mutable.Map[String, Int]()
+    place(II, unitStages, lane) { (n, earliest) =>
+      val mul = n.isInstanceOf[Mul]
+      def free(time: Int): Option[Int] = (0 until lanes).find(l => !used.contains((mul, time % II, l)))
+      var time = earliest
+      while (free(time).isEmpty) {
+        time += 1
+      }
+      lane(n.name) = free(time).get
+      used += ((mul, time % II, lane(n.name)))
+      time
+    }
+  }
+
+  // Fully pipelined, with a unit per node: a new operation can start every cycle
+  def pipeline(unitStages: Int = 0): Schedule = place(1, unitStages) { (_, earliest) => earliest }
+}
+
+// Start of each node relative to the start of the operation, the lane of its unit when the units are shared, and the
+// register stages of the units
+class Schedule(val flow: Dataflow, val II: Int, val start: Map[String, Int], val lane: Map[String, Int],
+               val unitStages: Int = 0) {
+  import Dataflow._
+
+  // Cycle at which the result of a unit or of a custom node is given, and registered
+  def done(name: String): Int = flow.node(name) match {
+    case n: Custom => start(name) + n.latency - 1
+    case n if isUnit(n) => start(name) + unitStages
+    case _ => start(name)
+  }
+
+  // Cycles from the start of an operation to its last result, and number of operations in flight at most
+  val length = start.keys.map(done).max + 1
+  val stages = (length + II - 1) / II
+
+  // Last cycle at which a value is used, -1 if it isn't
+  def lastUse(name: String): Int = flow.nodes.filter(_.args.contains(name)).map {
+    case n @ (_: Logic | _: Load) => lastUse(n.name)
+    case n => start(n.name)
+  }.foldLeft(-1)(_ max _)
+
+  // Registers needed by a value, so that the operations in flight don't overwrite it before it is used.
+  // Rounded up to a power of 2, the copy is then selected by the low bits of the window number.
+  def copies(name: String): Int = flow.node(name) match {
+    case _: Input => if (lastUse(name) < 1) 0 else 1 << log2Ceil((lastUse(name) - 1) / II + 1)
+    case n @ (_: Mul | _: Add | _: Fma | _: Custom) =>
+      if (lastUse(name) <= done(name)) 0 else 1 << log2Ceil((lastUse(name) - done(name) - 1) / II + 1)
+    case _ => 0
+  }
+}
+
+// Hardware running a modulo schedule on the given units, a new operation starts when issue is high.
+// The operations must be issued every II cycles, or after the previous ones are done.
+// The hardware of the custom nodes is built by the first operation given customUnits, and shared with the next ones
+// given the same map, like the units, for schedules that never run at the same time
+class ScheduledOperation(
+  val sched: Schedule,
+  mults: Seq[FPMultiplier],
+  fmas: Seq[FPFMA],
+  issue: Bool,
+  flush: Bool, // Drop the operations in flight
+  inputs: Map[String, UInt],
+  loads: Map[String, Seq[UInt] => UInt],
+  stores: Map[String, Seq[UInt] => Unit],
+  customUnits: Dataflow.CustomUnits = Dataflow.customUnits()
+) {
+  import Dataflow._
+  require(mults.forall(_.stages == sched.unitStages) && fmas.forall(_.stages == sched.unitStages),
+    "The units must have the stages of the schedule")
+  require(mults.forall(_.format == sched.flow.format) && fmas.forall(_.format == sched.flow.format),
+    "The units must have the format of the dataflow")
+
+  val format = sched.flow.format
+
+  val II = sched.II
+  val tag_width = log2Ceil(sched.flow.nodes.map(n => sched.copies(n.name)).max).max(1)
+
+  // Cycle in the window of II cycles, a new window starts with each operation
+  val phase_reg = RegInit(0.U(log2Ceil(II).max(1).W))
+  val phase = Mux(issue, 0.U, Mux(phase_reg === (II - 1).U, 0.U, phase_reg + 1.U))
+  phase_reg := phase
+  val new_window = phase === 0.U
+
+  // Bit j is set when an operation started j windows ago
+  val in_flight_reg = RegInit(0.U(sched.stages.W))
+  val in_flight = Mux(new_window, Cat(in_flight_reg, issue)(sched.stages - 1, 0), in_flight_reg)
+  in_flight_reg := Mux(flush, 0.U, in_flight)
+
+  // The values of an operation are held in the copy selected by the window in which it started
+  val window_reg = RegInit(0.U(tag_width.W))
+  val window = Mux(new_window, window_reg + 1.U, window_reg)
+  window_reg := window
+
+  def active(time: Int): Bool = in_flight(time / II) && phase === (time % II).U
+
+  def select(name: String, time: Int): UInt = {
+    val copies = sched.copies(name)
+    if (copies == 1) 0.U else (window - (time / II).U)(log2Ceil(copies) - 1, 0)
+  }
+
+  val values = (for (n <- sched.flow.nodes if sched.copies(n.name) > 0)
+    yield n.name -> Reg(Vec(sched.copies(n.name), UInt(format.width.W)))).toMap
+  // Output of the hardware of the custom nodes
+  private val customs = mutable.Map[String, UInt]()
+
+  // Value of a node, as seen by a node running at the given cycle of the same operation
+  private val cache = mutable.Map[(String, Int), UInt]()
+  def read(name: String, time: Int): UInt = cache.get((name, time)) match {
+    case Some(value) => value
+    case None =>
+      val value = sched.flow.node(name) match {
+        case _: Input if time == 0 => inputs(name)
+        case _: Mul if time == sched.done(name) => mults(sched.lane(name)).io.out
+        case n if isUnit(n) && time == sched.done(name) => fmas(sched.lane(name)).io.out
+        case _: Custom if time == sched.done(name) => customs(name)
+        case n: Logic => n.f(n.args.map(read(_, time)))
+        case n: Load => loads(name)(n.args.map(read(_, time)))
+        case _ => values(name)(select(name, time))
+      }
+      cache((name, time)) = value
+      value
+  }
+
+  // The result of a unit is kept when it comes out, stages cycles after the unit was started
+  def result(name: String, out: UInt): Unit = {
+    val time = sched.done(name)
+    if (values.contains(name)) {
+      when (active(time)) {
+        values(name)(select(name, time)) := out
+      }
+    }
+  }
+
+  for (n <- sched.flow.nodes) {
+    n match {
+      case Input(name) =>
+        if (values.contains(name)) {
+          when (issue) {
+            values(name)(select(name, 0)) := inputs(name)
+          }
+        }
+      case Mul(name, args) =>
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        val mult = mults(sched.lane(name))
+        when (active(time)) {
+          mult.io.a := operands(0)
+          mult.io.b := operands(1)
+        }
+        result(name, mult.io.out)
+      case Add(name, args, substract) =>
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        val fma = fmas(sched.lane(name))
+        when (active(time)) {
+          // a +/- b * 1
+          fma.io.a := operands(1)
+          fma.io.b := format.one
+          fma.io.c := operands(0)
+          fma.io.negate := substract.B
+        }
+        result(name, fma.io.out)
+      case Fma(name, args, negate) =>
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        val fma = fmas(sched.lane(name))
+        when (active(time)) {
+          fma.io.a := operands(0)
+          fma.io.b := operands(1)
+          fma.io.c := operands(2)
+          fma.io.negate := negate.B
+        }
+        result(name, fma.io.out)
+      case Custom(name, args, _, f) =>
+        // The hardware runs every cycle, its inputs are driven and its result kept at the cycles of an operation
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        val (ins, out) = customUnits.getOrElseUpdate(name, {
+          val ins = args.map(_ => WireDefault(UInt(), 0.U))
+          (ins, f(ins))
+        })
+        when (active(time)) {
+          for ((in, operand) <- ins.zip(operands)) {
+            in := operand
+          }
+        }
+        customs(name) = out
+        result(name, out)
+      case Store(name, args) =>
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        when (active(time)) {
+          stores(name)(operands)
+        }
+      case _ =>
+    }
+  }
+
+  // An operation is running as long as some of its nodes are still to come
+  val busy = (0 until sched.stages).map { j =>
+    if (j < sched.stages - 1) in_flight(j) else in_flight(j) && phase <= (sched.length - 1 - j * II).U
+  }.reduce(_ || _)
+}
+
+// Hardware running a pipelined schedule, with its own units, of the stages of the schedule, and a register after each
+// of them.
+// A new operation can start at every cycle where valid is high.
+class PipelinedOperation(
+  val sched: Schedule,
+  valid: Bool,
+  inputs: Map[String, UInt],
+  loads: Map[String, Seq[UInt] => UInt],
+  stores: Map[String, Seq[UInt] => Unit]
+) {
+  import Dataflow._
+
+  val format = sched.flow.format
+
+  // Valid bit of the operation started the given number of cycles ago
+  val valids = mutable.ArrayBuffer(valid)
+  for (_ <- 1 until sched.length) {
+    valids += RegNext(valids.last, false.B)
+  }
+
+  // Each value goes down a chain of registers until its last use, element k is the value k cycles after it is computed
+  private val outputs = mutable.Map[String, UInt]()
+  private val chains = mutable.Map[String, mutable.ArrayBuffer[UInt]]()
+  private def delayed(name: String, first: UInt, firstTime: Int, time: Int): UInt = {
+    val chain = chains.getOrElseUpdate(name, mutable.ArrayBuffer(first))
+    while (firstTime + chain.length - 1 < time) {
+      chain += RegNext(chain.last)
+    }
+    chain(time - firstTime)
+  }
+
+  private val cache = mutable.Map[(String, Int), UInt]()
+  def read(name: String, time: Int): UInt = cache.get((name, time)) match {
+    case Some(value) => value
+    case None =>
+      val value = sched.flow.node(name) match {
+        case _: Input => delayed(name, inputs(name), 0, time)
+        case n: Logic => n.f(n.args.map(read(_, time)))
+        case n: Load => loads(name)(n.args.map(read(_, time)))
+        case _ => delayed(name, outputs(name), sched.done(name), time)
+      }
+      cache((name, time)) = value
+      value
+  }
+
+  for (n <- sched.flow.nodes) {
+    n match {
+      case Mul(name, args) =>
+        val operands = args.map(read(_, sched.start(name)))
+        val mult = Module(new FPMultiplier(format, sched.unitStages))
+        mult.io.a := operands(0)
+        mult.io.b := operands(1)
+        outputs(name) = mult.io.out
+      case Add(name, args, substract) =>
+        val operands = args.map(read(_, sched.start(name)))
+        val fma = Module(new FPFMA(format, sched.unitStages))
+        fma.io.a := operands(1)
+        fma.io.b := format.one
+        fma.io.c := operands(0)
+        fma.io.negate := substract.B
+        outputs(name) = fma.io.out
+      case Fma(name, args, negate) =>
+        val operands = args.map(read(_, sched.start(name)))
+        val fma = Module(new FPFMA(format, sched.unitStages))
+        fma.io.a := operands(0)
+        fma.io.b := operands(1)
+        fma.io.c := operands(2)
+        fma.io.negate := negate.B
+        outputs(name) = fma.io.out
+      case Custom(name, args, _, f) =>
+        outputs(name) = f(args.map(read(_, sched.start(name))))
+      case Store(name, args) =>
+        val time = sched.start(name)
+        val operands = args.map(read(_, time))
+        when (valids(time)) {
+          stores(name)(operands)
+        }
+      case _ =>
+    }
+  }
+
+  val busy = valids.reduce(_ || _)
+}
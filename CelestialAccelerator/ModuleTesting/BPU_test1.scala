@@ -9,6 +9,11 @@ import java.lang.Float
 class BPU_test extends AnyFlatSpec with ChiselScalatestTester {
   "BPU" should "Set position and velocity to input" in {
     test(new BPU) { c =>
+      // Single record, no external sync
+      c.io.slot.poke(0.U)
+      c.io.out_slot.poke(0.U)
+      c.io.sync.poke(false.B)
+      c.io.refinements.poke(BPU.maxRefinements.U)
       // Test 1 : send in position, mass, and size
       c.io.X_in.poke(10.U)
       c.io.Y_in.poke(20.U)
@@ -40,6 +45,11 @@ class BPU_test extends AnyFlatSpec with ChiselScalatestTester {
 
   "BPU" should "Update velocity as expected for various parameters" in {
     test(new BPU) { dut =>
+      // Single record, no external sync
+      dut.io.slot.poke(0.U)
+      dut.io.out_slot.poke(0.U)
+      dut.io.sync.poke(false.B)
+      dut.io.refinements.poke(BPU.maxRefinements.U)
 
       // Define sets of parameters to try
       val testCases = Seq(
@@ -115,7 +125,12 @@ class BPU_test extends AnyFlatSpec with ChiselScalatestTester {
         dut.io.m_in.poke(secondObjectMassBits.U)
         dut.io.size_in.poke(secondObjectSizeBits.U)
 
-        dut.clock.step(24)
+        // One window to send the body, then wait for the update to finish
+        dut.clock.step(BPU.velocityWindow(1))
+        dut.io.m_slct.poke(6.U)
+        while (dut.io.pipeline_busy.peek().litToBoolean) {
+          dut.clock.step(1)
+        }
 
         // Step 4: Check the updated velocity
         dut.io.m_slct.poke(4.U)
@@ -150,6 +165,11 @@ class BPU_test extends AnyFlatSpec with ChiselScalatestTester {
 
   "BPU" should "Update position as expected for various parameters" in {
   test(new BPU) { dut =>
+    // Single record, no external sync
+    dut.io.slot.poke(0.U)
+    dut.io.out_slot.poke(0.U)
+    dut.io.sync.poke(false.B)
+    dut.io.refinements.poke(BPU.maxRefinements.U)
 
     val testCases = Seq(
       (0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 1.0),
@@ -195,7 +215,7 @@ class BPU_test extends AnyFlatSpec with ChiselScalatestTester {
 
       // Step 3: Request position update
       dut.io.m_slct.poke(1.U)
-      dut.clock.step(5) // Wait 4 cycles for the position to update
+      dut.clock.step(5) // Wait 3 cycles for the position to update
 
       // Step 4: Read back the updated position
       val actualPosX = dut.io.X_out.peek().litValue.toInt
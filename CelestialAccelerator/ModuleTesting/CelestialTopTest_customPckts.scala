@@ -24,7 +24,8 @@ test(new CelestialTop(4)) { c =>
     )
     // Send each of the packets and print the state of the lock
     for (pckt <- pckts_to_send) {
-      c.io.dIn.poke(pckt.U)
+      c.io.dIn.bits.poke(pckt.U)
+      c.io.dIn.valid.poke(true.B)
       println(p"Sending packet: ${pckt.toHexString}")
       
       c.clock.step(1)
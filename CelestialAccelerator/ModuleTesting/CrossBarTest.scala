@@ -102,12 +102,17 @@ class CrossBar_test extends AnyFlatSpec with ChiselScalatestTester {
           dut.io.m_slct.poke(1.U) // 1 = update position
           dut.clock.step(1)
         }
-        for (j <- 0 until 24) { // Must keep on poking the same value for 24 cycles
+        for (j <- 0 until BPU.velocityWindow(1)) { // Must keep on poking the same value for a whole window
           dut.io.m_slct.poke(0.U) // 0 = update velocity
           // Set target to 0 = sun
           dut.io.target.poke(0.U)
           dut.clock.step(1)
         }
+        // Wait for the velocity update to finish before moving the bodies
+        dut.io.m_slct.poke(6.U)
+        while (dut.io.pipeline_busy.peek().litToBoolean) {
+          dut.clock.step(1)
+        }
 
       }
 
@@ -0,0 +1,133 @@
+package celestial
+
+import chisel3._
+import chiseltest._
+import org.scalatest.flatspec.AnyFlatSpec
+import java.lang.Double.{longBitsToDouble, doubleToRawLongBits}
+
+// The units and NegThreeHalfExp in double precision, on the same inputs
+class F64UnitsTesterWrapper extends Module {
+  val format = FloatFormat.F64
+  val io = IO(new Bundle {
+    val a = Input(UInt(64.W))
+    val b = Input(UInt(64.W))
+    val c = Input(UInt(64.W))
+    val negate = Input(Bool())
+    val rst = Input(Bool())
+
+    val product = Output(UInt(64.W))
+    val fma = Output(UInt(64.W))
+    val sum = Output(UInt(64.W))
+    val negThreeHalf = Output(UInt(64.W)) // x^(-3/2) of a
+  })
+
+  val mult = Module(new FPMultiplier(format))
+  mult.io.a := io.a
+  mult.io.b := io.b
+  io.product := mult.io.out
+
+  val fma = Module(new FPFMA(format))
+  fma.io.a := io.a
+  fma.io.b := io.b
+  fma.io.c := io.c
+  fma.io.negate := io.negate
+  io.fma := fma.io.out
+
+  val adder = Module(new FPAdder(format))
+  adder.io.a := io.a
+  adder.io.b := io.b
+  adder.io.substracter := io.negate
+  io.sum := adder.io.sum
+
+  // Same wiring as F32FastNegThreeHalfFullTesterTesterWrapper
+  val negThreeHalfExp = Module(new NegThreeHalfExp(format = format))
+  val refineMult = Module(new FPMultiplier(format))
+  val refineAdder = Module(new FPAdder(format))
+  negThreeHalfExp.io.in := io.a
+  negThreeHalfExp.io.rst := io.rst
+  refineMult.io.a := negThreeHalfExp.io.mulA
+  refineMult.io.b := negThreeHalfExp.io.mulB
+  refineAdder.io.a := negThreeHalfExp.io.subA
+  refineAdder.io.b := negThreeHalfExp.io.subB
+  refineAdder.io.substracter := true.B
+  negThreeHalfExp.io.mulOut := refineMult.io.out
+  negThreeHalfExp.io.subOut := refineAdder.io.sum
+  io.negThreeHalf := negThreeHalfExp.io.out
+}
+
+class F64UnitsTester extends AnyFlatSpec with ChiselScalatestTester {
+  def bits(x: Double): UInt = (BigInt(doubleToRawLongBits(x)) & ((BigInt(1) << 64) - 1)).U(64.W)
+  def double(x: UInt): Double = longBitsToDouble(x.litValue.toLong)
+
+  val random = new scala.util.Random(20)
+  def randomDouble(): Double = {
+    val exponent = random.nextInt(200) - 100
+    val x = (1.0 + random.nextDouble()) * math.pow(2.0, exponent)
+    if (random.nextBoolean()) -x else x
+  }
+  val specialValues = List(0.0, 1.0, -1.0, 1.5, Double.MaxValue, Double.NaN, Double.PositiveInfinity,
+    Double.NegativeInfinity)
+
+  // The units truncate, so the results are at most a few units in the last place off the rounded reference
+  def check(name: String, out: Double, expected: Double, tolerance: Double): Unit = {
+    if (expected.isNaN) {
+      assert(out.isNaN, s"Failed on $name: got $out")
+    } else if (expected.isInfinite) {
+      assert(out == expected, s"Failed on $name: got $out, expected $expected")
+    } else {
+      assert(math.abs(out - expected) <= tolerance || math.abs(out - expected) <= java.lang.Double.MIN_NORMAL,
+        s"Failed on $name: got $out, expected $expected")
+    }
+  }
+
+  "FPMultiplier, FPFMA and FPAdder" should "compute in double precision" in {
+    test(new F64UnitsTesterWrapper) { dut =>
+      def testUnits(a: Double, b: Double, c: Double, negate: Boolean): Unit = {
+        dut.io.a.poke(bits(a))
+        dut.io.b.poke(bits(b))
+        dut.io.c.poke(bits(c))
+        dut.io.negate.poke(negate.B)
+        dut.clock.step(1)
+
+        val sign = if (negate) -1.0 else 1.0
+        check(s"$a * $b", double(dut.io.product.peek()), a * b, 4.5e-16 * math.abs(a * b))
+        check(s"$c + $sign * $a * $b", double(dut.io.fma.peek()), c + sign * a * b,
+          1e-15 * (math.abs(a * b) + math.abs(c)))
+        check(s"$a + $sign * $b", double(dut.io.sum.peek()), a + sign * b, 1e-15 * (math.abs(a) + math.abs(b)))
+      }
+
+      for (a <- specialValues; b <- specialValues) {
+        testUnits(a, b, 1.0, false)
+      }
+      for (_ <- 0 until 300) {
+        testUnits(randomDouble(), randomDouble(), randomDouble(), random.nextBoolean())
+      }
+      // Newton-Raphson step of the BPU, 1.5 - x / 2 * y
+      testUnits(0.25, 2.0, 1.5, true)
+    }
+  }
+
+  "NegThreeHalfExp" should "calculate x^(-3/2) to double precision with format.refinements passes" in {
+    test(new F64UnitsTesterWrapper) { dut =>
+      def testNegThreeHalf(x: Double): Unit = {
+        dut.io.rst.poke(true.B)
+        dut.io.a.poke(bits(x))
+        dut.clock.step(1)
+        dut.io.rst.poke(false.B)
+        dut.clock.step(NegThreeHalfExp.done(0, FloatFormat.F64))
+
+        // Four passes are about 2e-16 off, single precision stops at 1e-7
+        val expected = 1.0 / math.pow(x, 1.5)
+        check(s"($x)^(-3/2)", double(dut.io.negThreeHalf.peek()), expected, 1e-14 * math.abs(expected))
+      }
+
+      // Same values as FP_fNegThreeHalf_test
+      for (x <- Seq(0.0, 1.0, -1.0, 4.0, 9.0, 16.0, Double.NaN, Double.PositiveInfinity, -4.0, 0.15, 3.14159, 10000.0)) {
+        testNegThreeHalf(x)
+      }
+      for (_ <- 0 until 30) {
+        testNegThreeHalf(math.abs(randomDouble()))
+      }
+    }
+  }
+}
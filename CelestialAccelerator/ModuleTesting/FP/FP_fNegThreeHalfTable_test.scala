@@ -0,0 +1,62 @@
+package celestial
+
+import chisel3._
+import chiseltest._
+import org.scalatest.flatspec.AnyFlatSpec
+import java.lang.Float.{intBitsToFloat, floatToIntBits}
+import scala.math.pow
+
+class F32NegThreeHalfTableTester extends AnyFlatSpec with ChiselScalatestTester {
+  "NegThreeHalfExpTable" should "calculate x^(-3/2) as precisely as three refinements" in {
+    test(new NegThreeHalfExpTable) { dut =>
+      def testNegThreeHalf(x: Float): Unit = {
+        val expected = (1.0 / pow(x, 1.5)).toFloat
+
+        val xBits = java.lang.Integer.toUnsignedLong(floatToIntBits(x))
+        dut.io.in.poke(xBits.U)
+        dut.clock.step(NegThreeHalfExpTable.latency - 1)
+
+        val outFloat = intBitsToFloat(dut.io.out.peek().litValue.toInt)
+
+        if (expected.isNaN) {
+          assert(java.lang.Float.isNaN(outFloat), s"Failed on x^(-3/2) for $x")
+        } else if (expected.isInfinite) {
+          assert(outFloat == Float.PositiveInfinity, s"Failed on x^(-3/2) for $x")
+        } else {
+          // Three Newton-Raphson passes from the magic constant are at most 2e-7 off, FP_fNegThreeHalf_test
+          // only asks for 1e-3
+          val relativeError = if (expected != 0) math.abs((outFloat - expected) / expected) else math.abs(outFloat)
+          assert(relativeError <= 2.5e-7,
+            s"Failed on ($x)^(-3/2): got $outFloat, expected $expected, relative error: $relativeError")
+        }
+      }
+
+      // Same values as FP_fNegThreeHalf_test
+      val specialValues = List(0.0f, 1.0f, 4.0f, 9.0f, 16.0f, Float.NaN, Float.PositiveInfinity)
+      for (x <- specialValues) {
+        testNegThreeHalf(x)
+      }
+
+      testNegThreeHalf(-1.0f)
+      testNegThreeHalf(-4.0f)
+
+      val random = new scala.util.Random(123)
+      for (_ <- 0 until 30) {
+        val exponent = random.nextInt(30) - 15
+        val mantissa = 1.0f + random.nextFloat()
+        val x = mantissa * math.pow(2.0f, exponent).toFloat
+        testNegThreeHalf(x)
+      }
+
+      val quakeValues = List(0.15f, 2.0f, 3.14159f, 4.0f, 100.0f, 10000.0f)
+      for (x <- quakeValues) {
+        testNegThreeHalf(x)
+      }
+
+      // Both parities of the exponent, and the ends of the segments, over the whole range of the velocity update
+      for (exponent <- -60 to 60; fraction <- Seq(0, 1, 0x7FFF, 0x8000, 0xFFFF, 0x10000, 0x3FFFFF, 0x7FFFFF)) {
+        testNegThreeHalf(intBitsToFloat(((exponent + 127) << 23) | fraction))
+      }
+    }
+  }
+}
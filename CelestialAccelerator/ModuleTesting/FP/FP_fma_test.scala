@@ -0,0 +1,64 @@
+package celestial
+
+import chisel3._
+import chiseltest._
+import org.scalatest.flatspec.AnyFlatSpec
+import java.lang.Float.{intBitsToFloat, floatToIntBits}
+
+class F32FMATester extends AnyFlatSpec with ChiselScalatestTester {
+  "F32FMA" should "compute c + a * b correctly" in {
+    test(new F32FMA) { dut =>
+      def testFMA(a: Float, b: Float, c: Float, negate: Boolean): Unit = {
+        // Reference in double precision, the product of two floats is exact
+        val expected = (c + (if (negate) -1.0 else 1.0) * a.toDouble * b.toDouble).toFloat
+        dut.io.a.poke(java.lang.Integer.toUnsignedLong(floatToIntBits(a)).U(32.W))
+        dut.io.b.poke(java.lang.Integer.toUnsignedLong(floatToIntBits(b)).U(32.W))
+        dut.io.c.poke(java.lang.Integer.toUnsignedLong(floatToIntBits(c)).U(32.W))
+        dut.io.negate.poke(negate.B)
+        dut.clock.step(1)
+
+        val outFloat = intBitsToFloat(dut.io.out.peek().litValue.toInt)
+        val op = if (negate) "-" else "+"
+        println(f"---------Test: $c $op $a * $b = $outFloat (expected $expected)----------------")
+
+        if (expected.isNaN) {
+          assert(outFloat.isNaN, s"Failed on $c $op $a * $b")
+        } else if (expected.isInfinite) {
+          assert(outFloat == expected, s"Failed on $c $op $a * $b: got $outFloat, expected $expected")
+        } else {
+          val smallestFixedPoint = 1.18e-38f
+          assert(math.abs(outFloat - expected) <= math.abs(expected) * 0.000001f || math.abs(outFloat - expected) <= smallestFixedPoint, s"Failed on $c $op $a * $b: got $outFloat, expected $expected")
+        }
+      }
+
+      val specialValues = List(
+        0.0f, 1.0f, -1.0f, 1.5f,
+        Float.MaxValue,
+        Float.NaN,
+        Float.PositiveInfinity, Float.NegativeInfinity
+      )
+      for (a <- specialValues; b <- specialValues; c <- specialValues) {
+        testFMA(a, b, c, false)
+      }
+
+      val random = new scala.util.Random(0)
+      for (_ <- 0 until 200) {
+        val a = random.nextFloat() * 2e3f - 1e3f
+        val b = random.nextFloat() * 2e3f - 1e3f
+        val c = random.nextFloat() * 2e6f - 1e6f
+        testFMA(a, b, c, random.nextBoolean())
+      }
+
+      // Cancellation, where the single truncation matters the most
+      for (_ <- 0 until 100) {
+        val a = random.nextFloat() * 10f + 1f
+        val b = random.nextFloat() * 10f + 1f
+        testFMA(a, b, a * b, true)
+        testFMA(a, b, -(a * b) * 1.0001f, false)
+      }
+
+      // Newton-Raphson step of the BPU, 1.5 - x / 2 * y
+      testFMA(0.25f, 2.0f, 1.5f, true)
+    }
+  }
+}
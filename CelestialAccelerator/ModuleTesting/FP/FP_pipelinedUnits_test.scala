@@ -0,0 +1,126 @@
+package celestial
+
+import chisel3._
+import chiseltest._
+import chiseltest.simulator.VerilatorBackendAnnotation
+import org.scalatest.flatspec.AnyFlatSpec
+import java.lang.Float.{intBitsToFloat, floatToIntBits}
+
+// The units and NegThreeHalfExp with register stages, next to the combinational ones, on the same inputs
+class F32PipelinedUnitsTesterWrapper(stages: Int) extends Module {
+  val io = IO(new Bundle {
+    val a = Input(UInt(32.W))
+    val b = Input(UInt(32.W))
+    val c = Input(UInt(32.W))
+    val negate = Input(Bool())
+    val rst = Input(Bool())
+
+    // Combinational units, and the ones with stages
+    val product = Output(Vec(2, UInt(32.W)))
+    val fma = Output(Vec(2, UInt(32.W)))
+    val sum = Output(Vec(2, UInt(32.W)))
+    val negThreeHalf = Output(Vec(2, UInt(32.W))) // x^(-3/2) of a
+  })
+
+  for ((s, i) <- Seq(0, stages).zipWithIndex) {
+    val mult = Module(new F32Multiplier(s))
+    mult.io.a := io.a
+    mult.io.b := io.b
+    io.product(i) := mult.io.out
+
+    val fma = Module(new F32FMA(s))
+    fma.io.a := io.a
+    fma.io.b := io.b
+    fma.io.c := io.c
+    fma.io.negate := io.negate
+    io.fma(i) := fma.io.out
+
+    val adder = Module(new F32Adder(s))
+    adder.io.a := io.a
+    adder.io.b := io.b
+    adder.io.substracter := io.negate
+    io.sum(i) := adder.io.sum
+
+    // Same wiring as F32FastNegThreeHalfFullTesterTesterWrapper
+    val negThreeHalfExp = Module(new NegThreeHalfExp(s))
+    val refineMult = Module(new F32Multiplier(s))
+    val refineAdder = Module(new F32Adder(s))
+    negThreeHalfExp.io.in := io.a
+    negThreeHalfExp.io.rst := io.rst
+    refineMult.io.a := negThreeHalfExp.io.mulA
+    refineMult.io.b := negThreeHalfExp.io.mulB
+    refineAdder.io.a := negThreeHalfExp.io.subA
+    refineAdder.io.b := negThreeHalfExp.io.subB
+    refineAdder.io.substracter := true.B
+    negThreeHalfExp.io.mulOut := refineMult.io.out
+    negThreeHalfExp.io.subOut := refineAdder.io.sum
+    io.negThreeHalf(i) := negThreeHalfExp.io.out
+  }
+}
+
+class F32PipelinedUnitsTester extends AnyFlatSpec with ChiselScalatestTester {
+  def bits(x: Float): UInt = java.lang.Integer.toUnsignedLong(floatToIntBits(x)).U(32.W)
+
+  val random = new scala.util.Random(19)
+  def randomFloat(): Float = {
+    val exponent = random.nextInt(60) - 30
+    val x = (1.0f + random.nextFloat()) * math.pow(2.0f, exponent).toFloat
+    if (random.nextBoolean()) -x else x
+  }
+  val specialValues = List(0.0f, 1.0f, -1.0f, 1.5f, Float.MaxValue, Float.NaN, Float.PositiveInfinity,
+    Float.NegativeInfinity)
+
+  for (stages <- Seq(1, 2)) {
+    "F32Multiplier, F32FMA and F32Adder" should s"give the same bits with $stages stages, stages cycles later" in {
+      test(new F32PipelinedUnitsTesterWrapper(stages)).withAnnotations(Seq(VerilatorBackendAnnotation)) { dut =>
+        val inputs = (for (a <- specialValues; b <- specialValues) yield (a, b, 1.0f, false)) ++
+          Seq.fill(300)((randomFloat(), randomFloat(), randomFloat(), random.nextBoolean()))
+
+        // A new operation every cycle, the results of the combinational units wait for the ones with stages
+        val expected = scala.collection.mutable.Queue[(BigInt, BigInt, BigInt)]()
+        for ((a, b, c, negate) <- inputs ++ Seq.fill(stages)((0.0f, 0.0f, 0.0f, false))) {
+          dut.io.a.poke(bits(a))
+          dut.io.b.poke(bits(b))
+          dut.io.c.poke(bits(c))
+          dut.io.negate.poke(negate.B)
+          if (expected.length == stages) {
+            val (product, fma, sum) = expected.dequeue()
+            dut.io.product(1).expect(product.U, s"Product differs before $a, $b")
+            dut.io.fma(1).expect(fma.U, s"Fused multiply-add differs before $a, $b, $c")
+            dut.io.sum(1).expect(sum.U, s"Sum differs before $a, $b")
+          }
+          expected.enqueue((dut.io.product(0).peek().litValue, dut.io.fma(0).peek().litValue,
+            dut.io.sum(0).peek().litValue))
+          dut.clock.step(1)
+        }
+      }
+    }
+
+    "NegThreeHalfExp" should s"give the same bits with $stages stages, NegThreeHalfExp.done(stages) cycles later" in {
+      test(new F32PipelinedUnitsTesterWrapper(stages)).withAnnotations(Seq(VerilatorBackendAnnotation)) { dut =>
+        def testNegThreeHalf(x: Float): Unit = {
+          dut.io.rst.poke(true.B)
+          dut.io.a.poke(bits(x))
+          dut.clock.step(1)
+          dut.io.rst.poke(false.B)
+
+          // The result is given at done, then held
+          dut.clock.step(NegThreeHalfExp.done(stages))
+          val staged = dut.io.negThreeHalf(1).peek().litValue
+          dut.clock.step(1)
+          val reference = dut.io.negThreeHalf(0).peek().litValue
+          assert(staged == reference, s"Failed on ($x)^(-3/2): got ${intBitsToFloat(staged.toInt)}, " +
+            s"expected ${intBitsToFloat(reference.toInt)}")
+          dut.io.negThreeHalf(1).expect(reference.U, s"Result of ($x)^(-3/2) isn't held")
+        }
+
+        for (x <- specialValues ++ Seq(-4.0f, 4.0f, 9.0f, 16.0f, 0.15f, 3.14159f, 10000.0f)) {
+          testNegThreeHalf(x)
+        }
+        for (_ <- 0 until 30) {
+          testNegThreeHalf(math.abs(randomFloat()))
+        }
+      }
+    }
+  }
+}
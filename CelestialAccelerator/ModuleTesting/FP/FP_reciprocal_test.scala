@@ -0,0 +1,50 @@
+package celestial
+
+import chisel3._
+import chiseltest._
+import org.scalatest.flatspec.AnyFlatSpec
+import java.lang.Float.{intBitsToFloat, floatToIntBits}
+
+class F32ReciprocalTester extends AnyFlatSpec with ChiselScalatestTester {
+  "FPReciprocal" should "compute 1/x within one ulp" in {
+    test(new FPReciprocal(FloatFormat.F32)) { dut =>
+      def reciprocal(x: Float): Float = {
+        dut.io.in.poke((BigInt(floatToIntBits(x)) & 0xFFFFFFFFL).U)
+        dut.io.start.poke(true.B)
+        dut.clock.step(1)
+        dut.io.start.poke(false.B)
+        var cycles = 0
+        while (dut.io.busy.peek().litToBoolean) {
+          dut.clock.step(1)
+          cycles += 1
+        }
+        assert(cycles <= 25, s"1/$x took $cycles cycles")
+        intBitsToFloat(dut.io.out.peek().litValue.toInt)
+      }
+
+      // The powers of 2 are exact, the others are truncated
+      for (x <- Seq(1.0f, 4.0f, -0.5f, 1024.0f)) {
+        assert(reciprocal(x) == 1.0f / x, s"Failed on 1/$x")
+      }
+      val rand = new scala.util.Random(1)
+      for (x <- Seq(3.0f, 6.6743e-11f, -7.5f) ++ Seq.fill(200)(rand.nextFloat() * 2e6f - 1e6f) if x != 0.0f) {
+        val out = reciprocal(x)
+        val expected = 1.0 / x
+        assert(math.abs(out - expected) <= math.abs(expected) * math.pow(2, -23), s"Failed on 1/$x: got $out")
+        assert(math.abs(out) <= math.abs(expected), s"1/$x is not truncated: got $out")
+      }
+
+      // Special values, and 1/x leaving the normal range
+      assert(reciprocal(0.0f) == Float.PositiveInfinity)
+      assert(reciprocal(Float.NegativeInfinity) == -0.0f)
+      assert(reciprocal(Float.NaN).isNaN)
+      assert(reciprocal(1e38f) == 0.0f)
+
+      // A new start aborts the running one
+      dut.io.in.poke((BigInt(floatToIntBits(3.0f)) & 0xFFFFFFFFL).U)
+      dut.io.start.poke(true.B)
+      dut.clock.step(1)
+      assert(reciprocal(8.0f) == 0.125f)
+    }
+  }
+}